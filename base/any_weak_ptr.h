@@ -0,0 +1,133 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_ANY_WEAK_PTR_INCLUDE_H_
+#define XLIB_BASE_ANY_WEAK_PTR_INCLUDE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+
+#include "base/weak_ptr.h"
+
+namespace xcpp {
+
+namespace internal {
+
+// One byte per type, whose address is the type's tag: comparing tags is a
+// pointer compare and needs no RTTI. The byte is deliberately mutable: a
+// constant could share its address with an identical one under
+// -fmerge-all-constants or linker data folding, giving two types one tag.
+// Shared libraries built with hidden visibility get tags of their own.
+template <typename T> struct WeakTypeTag { static char id; };
+template <typename T> char WeakTypeTag<T>::id = 0;
+
+using WeakTypeId = const void *;
+
+template <typename T> constexpr WeakTypeId GetWeakTypeId() noexcept {
+  return &WeakTypeTag<T>::id;
+}
+
+} // namespace internal
+
+// A WeakPtr<void> that also remembers which WeakPtr<T> it was made from, so
+// the typed pointer can be recovered safely: As<T>() yields null instead of a
+// wrong cast when T doesn't match. Three words, a flat value type; neither
+// direction involves a virtual call or RTTI.
+//
+// The match is exact, apart from adding const: a handle made from
+// WeakPtr<Derived> converts back to WeakPtr<Derived>, not WeakPtr<Base>.
+// Convert to the type routing code expects before erasing it.
+class AnyWeakPtr {
+public:
+  constexpr AnyWeakPtr() noexcept = default;
+  constexpr AnyWeakPtr(std::nullptr_t) noexcept {}
+
+  template <typename T>
+  AnyWeakPtr(const WeakPtr<T> &weak) noexcept
+      : weak_(weak), type_(internal::GetWeakTypeId<T>()) {}
+  template <typename T>
+  AnyWeakPtr(WeakPtr<T> &&weak) noexcept
+      : weak_(std::move(weak)), type_(internal::GetWeakTypeId<T>()) {}
+
+  AnyWeakPtr(const AnyWeakPtr &other) noexcept = default;
+  AnyWeakPtr &operator=(const AnyWeakPtr &other) noexcept = default;
+  AnyWeakPtr(AnyWeakPtr &&other) noexcept
+      : weak_(std::move(other.weak_)), type_(other.type_) {
+    other.type_ = nullptr;
+  }
+  AnyWeakPtr &operator=(AnyWeakPtr &&other) noexcept {
+    weak_ = std::move(other.weak_);
+    type_ = other.type_;
+    other.type_ = nullptr;
+    return *this;
+  }
+
+  // Whether the handle was made from a WeakPtr<T>, alive or not.
+  template <typename T> bool Is() const noexcept {
+    return type_ && (type_ == internal::GetWeakTypeId<T>() ||
+                     (std::is_const<T>::value &&
+                      type_ == internal::GetWeakTypeId<
+                                   typename std::remove_const<T>::type>()));
+  }
+
+  // The typed WeakPtr, null if T doesn't match. Validity is checked on use,
+  // as with any WeakPtr.
+  template <typename T> WeakPtr<T> As() const noexcept {
+    return Is<T>() ? WeakPtr<T>(weak_) : WeakPtr<T>();
+  }
+
+  const WeakPtr<void> &untyped() const noexcept { return weak_; }
+  internal::WeakTypeId type() const noexcept { return type_; }
+
+  void *get() const noexcept { return weak_.get(); }
+  explicit operator bool() const noexcept { return get() != nullptr; }
+
+  void reset() noexcept {
+    weak_.reset();
+    type_ = nullptr;
+  }
+
+  // Identity: same object, same flag, same type. Unlike WeakPtr's operator==
+  // it doesn't load the flag, and dead handles stay equal to themselves.
+  bool operator==(const AnyWeakPtr &other) const noexcept {
+    return type_ == other.type_ && WeakPtrIdentityEqual()(weak_, other.weak_);
+  }
+  bool operator!=(const AnyWeakPtr &other) const noexcept {
+    return !(*this == other);
+  }
+
+private:
+  WeakPtr<void> weak_;
+  internal::WeakTypeId type_ = nullptr;
+};
+
+static_assert(sizeof(AnyWeakPtr) == 3 * sizeof(void *),
+              "AnyWeakPtr must stay three words.");
+static_assert(!std::is_polymorphic<AnyWeakPtr>::value &&
+                  std::is_nothrow_move_constructible<AnyWeakPtr>::value,
+              "AnyWeakPtr must stay a flat value type.");
+
+template <>
+struct is_trivially_relocatable<AnyWeakPtr> : std::true_type {};
+
+} // namespace xcpp
+
+namespace std {
+
+template <> struct hash<xcpp::AnyWeakPtr> {
+  std::size_t operator()(const xcpp::AnyWeakPtr &handle) const noexcept {
+    return std::uintptr_t(handle.untyped());
+  }
+};
+
+} // namespace std
+
+#endif // !XLIB_BASE_ANY_WEAK_PTR_INCLUDE_H_
@@ -0,0 +1,99 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_BIND_WEAK_INCLUDE_H_
+#define XLIB_BASE_BIND_WEAK_INCLUDE_H_
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "base/inline_callback.h"
+#include "base/weak_ptr.h"
+
+namespace xcpp {
+
+namespace internal {
+
+template <typename Method> struct MethodTraits;
+template <typename R, typename C, typename... Params>
+struct MethodTraits<R (C::*)(Params...)> {
+  using Return = R;
+};
+template <typename R, typename C, typename... Params>
+struct MethodTraits<R (C::*)(Params...) const> {
+  using Return = R;
+};
+
+// The callable returned by BindWeak(). Bound arguments are stored by value
+// and passed as lvalues, so the callable can run repeatedly; call arguments
+// are forwarded.
+template <typename Method, typename T, typename... Bound>
+class WeakBoundMethod {
+public:
+  template <typename... BoundArgs>
+  WeakBoundMethod(Method method, WeakPtr<T> &&weak, BoundArgs &&... bound)
+      : method_(method), weak_(std::move(weak)),
+        bound_(std::forward<BoundArgs>(bound)...) {}
+
+  // Checks the target once and does nothing if it is gone.
+  template <typename... Args> void operator()(Args &&... args) {
+    if (T *target = weak_.get())
+      Invoke(target, std::index_sequence_for<Bound...>(),
+             std::forward<Args>(args)...);
+  }
+
+  bool IsCancelled() const { return !weak_; }
+
+private:
+  template <std::size_t... I, typename... Args>
+  void Invoke(T *target, std::index_sequence<I...>, Args &&... args) {
+    (target->*method_)(std::get<I>(bound_)..., std::forward<Args>(args)...);
+  }
+
+  Method method_;
+  WeakPtr<T> weak_;
+  std::tuple<Bound...> bound_;
+};
+
+struct BindWeakProbe {
+  void Method(void *, void *, void *, void *) {}
+};
+
+static_assert(
+    sizeof(WeakBoundMethod<decltype(&BindWeakProbe::Method), BindWeakProbe,
+                           void *, void *, void *, void *>) <=
+        kInlineCallbackCapacity,
+    "A method, a WeakPtr and four word-sized arguments must fit inline.");
+
+} // namespace internal
+
+// Binds |method| to the object |weak| points to, plus leading |bound|
+// arguments. Running the result after the object's WeakPtrs were invalidated
+// is a no-op, hence the void return. The result converts to WeakCallback
+// without allocating while the bound state fits kInlineCallbackCapacity.
+//
+//   task_queue.Post(BindWeak(&Connection::OnData, weak_factory_.GetWeakPtr()));
+template <typename Method, typename T, typename... Bound>
+internal::WeakBoundMethod<Method, T, std::decay_t<Bound>...>
+BindWeak(Method method, WeakPtr<T> weak, Bound &&... bound) {
+  static_assert(std::is_member_function_pointer<Method>::value,
+                "BindWeak() binds member functions.");
+  static_assert(
+      std::is_void<typename internal::MethodTraits<Method>::Return>::value,
+      "Weak calls can be cancelled, so the method must return void.");
+  return internal::WeakBoundMethod<Method, T, std::decay_t<Bound>...>(
+      method, std::move(weak), std::forward<Bound>(bound)...);
+}
+
+template <typename... Args> using WeakCallback = InlineCallback<void(Args...)>;
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_BIND_WEAK_INCLUDE_H_
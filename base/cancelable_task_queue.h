@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_CANCELABLE_TASK_QUEUE_INCLUDE_H_
+#define XLIB_BASE_CANCELABLE_TASK_QUEUE_INCLUDE_H_
+
+#include <cassert>
+#include <cstddef>
+#include <deque>
+#include <unordered_map>
+#include <utility>
+
+#include "base/inline_callback.h"
+#include "base/weak_ptr.h"
+
+namespace xcpp {
+
+// A task queue that groups tasks by the flag of the WeakPtr they were posted
+// for. InvalidateWeakPtrs() on the owner drops and frees the owner's whole
+// group right away, so cancelled work neither occupies the queue nor costs a
+// wakeup later.
+//
+// Tasks of one group run in posting order; groups take turns, one task each.
+// Tasks posted without an owner form one group that is never cancelled.
+//
+// Not thread-safe; use it on the sequence its owners live on, which is also
+// where they invalidate.
+class CancelableTaskQueue {
+public:
+  using Task = InlineCallback<void()>;
+
+  CancelableTaskQueue() = default;
+  ~CancelableTaskQueue() {
+    while (cursor_)
+      DropGroup(cursor_);
+  }
+
+  // Tasks for an owner that is already gone are dropped on the spot.
+  template <typename T> void Post(const WeakPtr<T> &owner, Task task) {
+    const internal::FlagRef &flag = internal::WeakPtrAccess::GetFlag(owner);
+    if (!flag.IsValid())
+      return;
+    PostToGroup(flag, std::move(task));
+  }
+  void Post(Task task) { PostToGroup(internal::FlagRef(), std::move(task)); }
+
+  // Runs one task, returns false if the queue was empty.
+  bool RunNext() {
+    if (!cursor_)
+      return false;
+    Group *group = cursor_;
+    Task task = std::move(group->tasks.front());
+    group->tasks.pop_front();
+    --size_;
+    if (group->tasks.empty())
+      DropGroup(group);
+    else
+      cursor_ = group->next;
+    // |task| may post, invalidate or even run the queue recursively.
+    task();
+    return true;
+  }
+
+  // Runs until empty, including tasks posted meanwhile. Returns the count.
+  std::size_t RunUntilIdle() {
+    std::size_t ran = 0;
+    while (RunNext())
+      ++ran;
+    return ran;
+  }
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::size_t group_count() const { return groups_.size(); }
+
+private:
+  CancelableTaskQueue(const CancelableTaskQueue &) = delete;
+  CancelableTaskQueue &operator=(const CancelableTaskQueue &) = delete;
+
+  // One per flag; a member of the round-robin ring while it has tasks.
+  struct Group final : public internal::FlagObserver {
+    Group(CancelableTaskQueue *queue, const internal::FlagRef &flag)
+        : queue(queue), flag(flag) {}
+
+    void OnFlagInvalidated() override { queue->DropGroup(this); }
+
+    CancelableTaskQueue *const queue;
+    const internal::FlagRef flag;
+    std::deque<Task> tasks;
+    Group *prev = nullptr;
+    Group *next = nullptr;
+  };
+
+  void PostToGroup(const internal::FlagRef &flag, Task task) {
+    assert(task);
+    Group *&group = groups_[flag.get()];
+    if (!group) {
+      group = new Group(this, flag);
+      if (flag)
+        flag->AddObserver(group);
+      Link(group);
+    }
+    group->tasks.push_back(std::move(task));
+    ++size_;
+  }
+
+  // Unlinks, unregisters and frees |group| with the tasks it still holds.
+  void DropGroup(Group *group) {
+    if (group->flag)
+      group->flag->RemoveObserver(group);
+    groups_.erase(group->flag.get());
+    Unlink(group);
+    size_ -= group->tasks.size();
+    delete group;
+  }
+
+  // New groups go last in the ring, i.e. right before the cursor.
+  void Link(Group *group) {
+    if (!cursor_) {
+      group->prev = group->next = group;
+      cursor_ = group;
+      return;
+    }
+    group->next = cursor_;
+    group->prev = cursor_->prev;
+    cursor_->prev->next = group;
+    cursor_->prev = group;
+  }
+
+  void Unlink(Group *group) {
+    if (group->next == group) {
+      cursor_ = nullptr;
+    } else {
+      group->prev->next = group->next;
+      group->next->prev = group->prev;
+      if (cursor_ == group)
+        cursor_ = group->next;
+    }
+    group->prev = group->next = nullptr;
+  }
+
+  std::unordered_map<const internal::Flag *, Group *> groups_;
+  Group *cursor_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_CANCELABLE_TASK_QUEUE_INCLUDE_H_
@@ -0,0 +1,484 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_FLAG_POOL_INCLUDE_H_
+#define XLIB_BASE_FLAG_POOL_INCLUDE_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace xcpp {
+
+struct FlagPoolStats {
+  std::size_t live_flags = 0;
+  std::size_t allocations = 0;
+  // Allocations served from a free list instead of fresh slab memory.
+  std::size_t reused = 0;
+  std::size_t bytes_reserved = 0;
+
+  double reuse_rate() const {
+    return allocations ? static_cast<double>(reused) / allocations : 0.0;
+  }
+};
+
+namespace internal {
+
+// Nodes beyond this share free lists modulo kMaxNumaNodes.
+constexpr unsigned kMaxNumaNodes = 8;
+// Largest block alignment a pool serves, enough for cache-line flags.
+constexpr std::size_t kMaxFlagPoolAlign = 64;
+
+// The NUMA node of the CPU the caller runs on right now; 0 where the platform
+// doesn't tell. A syscall, so callers sample it once per batch of blocks.
+inline unsigned CurrentNumaNode() {
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+    return node % kMaxNumaNodes;
+#endif
+  return 0;
+}
+
+// The NUMA node the page holding |address| actually lives on, which for
+// recycled heap memory needn't be the node of whoever touched it last. Falls
+// back to CurrentNumaNode() where the platform doesn't tell. A syscall; the
+// pools ask once per slab.
+inline unsigned NumaNodeOf(const void *address) {
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+  // MPOL_F_NODE | MPOL_F_ADDR from <linux/mempolicy.h>.
+  constexpr unsigned long kNodeOfAddress = (1 << 0) | (1 << 1);
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, nullptr, 0UL, address,
+              kNodeOfAddress) == 0 &&
+      node >= 0)
+    return static_cast<unsigned>(node) % kMaxNumaNodes;
+#endif
+  return CurrentNumaNode();
+}
+
+class FlagPoolBase;
+
+// Every size class registers here so GetFlagPoolStats() can sum them up.
+class FlagPoolRegistry {
+public:
+  static FlagPoolRegistry &Get() {
+    static FlagPoolRegistry *registry = new FlagPoolRegistry;
+    return *registry;
+  }
+
+  void Register(FlagPoolBase *pool) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pools_.push_back(pool);
+  }
+
+  template <typename Function> void ForEach(Function function) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto *pool : pools_)
+      function(*pool);
+  }
+
+private:
+  FlagPoolRegistry() = default;
+
+  std::mutex mutex_;
+  std::vector<FlagPoolBase *> pools_;
+};
+
+// Size-independent part of a pool: the shared free lists that threads spill
+// into, one per NUMA node, and the stats of the thread caches.
+class FlagPoolBase {
+public:
+  void AddStats(FlagPoolStats *stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t allocations = retired_.allocations;
+    std::size_t frees = retired_.frees;
+    std::size_t reused = retired_.reused;
+    for (auto *counters : caches_) {
+      allocations += counters->allocations.load(std::memory_order_relaxed);
+      frees += counters->frees.load(std::memory_order_relaxed);
+      reused += counters->reused.load(std::memory_order_relaxed);
+    }
+    stats->allocations += allocations;
+    stats->reused += reused;
+    // Snapshots of different threads race, so clamp rather than wrap.
+    stats->live_flags += allocations > frees ? allocations - frees : 0;
+    stats->bytes_reserved += bytes_reserved_;
+  }
+
+protected:
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  // A block always goes back to the list of the node its slab's memory is on,
+  // and threads refill from the list of the node they run on, so recycled
+  // blocks are local to the thread that gets them. That holds for blocks
+  // freed on other threads and after migrations too.
+  struct NodeFreeList {
+    std::mutex mutex;
+    FreeBlock *head = nullptr;
+  };
+
+  // Written only by the owning thread; relaxed stores keep readers race-free
+  // without a locked read-modify-write on the hot path.
+  struct ThreadCounters {
+    std::atomic<std::size_t> allocations{0};
+    std::atomic<std::size_t> frees{0};
+    std::atomic<std::size_t> reused{0};
+
+    static void Increment(std::atomic<std::size_t> &counter) {
+      counter.store(counter.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    }
+  };
+
+  struct RetiredCounters {
+    std::size_t allocations = 0;
+    std::size_t frees = 0;
+    std::size_t reused = 0;
+  };
+
+  FlagPoolBase() { FlagPoolRegistry::Get().Register(this); }
+  ~FlagPoolBase() = default;
+
+  // Guards everything but the free lists.
+  std::mutex mutex_;
+  NodeFreeList free_lists_[kMaxNumaNodes];
+  std::size_t bytes_reserved_ = 0;
+  RetiredCounters retired_;
+  std::vector<ThreadCounters *> caches_;
+
+private:
+  FlagPoolBase(const FlagPoolBase &) = delete;
+  FlagPoolBase &operator=(const FlagPoolBase &) = delete;
+};
+
+// A slab allocator for blocks of one size. Each thread carves blocks out of
+// its own slab and recycles them through its own free list; only refills and
+// spills take a node's free list mutex. Slabs are never returned to the
+// system, blocks freed on another thread join that thread's free list until
+// it spills them to their home node.
+//
+// Slabs are kSlabSize-aligned and start with a header naming their node, so
+// a block finds its node by masking its address.
+template <std::size_t Size, std::size_t Align>
+class FixedSizePool : public FlagPoolBase {
+  static_assert(Align <= kMaxFlagPoolAlign && (Align & (Align - 1)) == 0,
+                "Unsupported block alignment.");
+
+public:
+  static constexpr std::size_t kBlockSize =
+      ((Size < sizeof(FreeBlock) ? sizeof(FreeBlock) : Size) + Align - 1) &
+      ~(Align - 1);
+  static constexpr std::size_t kSlabSize = 16 * 1024;
+  // Slabs are cut from chunks with one slab of slack for the alignment.
+  static constexpr std::size_t kSlabsPerChunk = 8;
+  static constexpr std::size_t kMaxCached = 256;
+  static constexpr std::size_t kBatch = kMaxCached / 2;
+
+  static FixedSizePool &Get() {
+    static FixedSizePool *pool = new FixedSizePool;
+    return *pool;
+  }
+
+  void *Allocate() {
+    ThreadCache *cache = LocalCache();
+    if (!cache)
+      return AllocateShared();
+    ThreadCounters::Increment(cache->allocations);
+    // Local free list first, then the current slab, and only then the shared
+    // list, so the pool mutex is taken once per slab at most.
+    if (!cache->head && cache->cursor == cache->end)
+      Refill(cache);
+    if (FreeBlock *block = cache->head) {
+      cache->head = block->next;
+      --cache->count;
+      ThreadCounters::Increment(cache->reused);
+      return block;
+    }
+    if (cache->cursor == cache->end)
+      NewSlab(cache);
+    void *block = cache->cursor;
+    cache->cursor += kBlockSize;
+    return block;
+  }
+
+  void Deallocate(void *ptr) {
+    FreeBlock *block = static_cast<FreeBlock *>(ptr);
+    ThreadCache *cache = LocalCache();
+    if (!cache) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++retired_.frees;
+      }
+      NodeFreeList &list = free_lists_[NodeOf(block)];
+      std::lock_guard<std::mutex> lock(list.mutex);
+      block->next = list.head;
+      list.head = block;
+      return;
+    }
+    ThreadCounters::Increment(cache->frees);
+    block->next = cache->head;
+    cache->head = block;
+    if (++cache->count > kMaxCached)
+      Spill(cache, kBatch);
+  }
+
+private:
+  enum class CacheState : unsigned char { kUnset, kLive, kDead };
+
+  struct ThreadCache : ThreadCounters {
+    explicit ThreadCache(CacheState *state) : state(state) {
+      *state = CacheState::kLive;
+      FixedSizePool::Get().Attach(this);
+    }
+    ~ThreadCache() {
+      FixedSizePool::Get().Detach(this);
+      *state = CacheState::kDead;
+    }
+
+    CacheState *state;
+    FreeBlock *head = nullptr;
+    std::size_t count = 0;
+    char *cursor = nullptr;
+    char *end = nullptr;
+  };
+
+  static_assert((kSlabSize & (kSlabSize - 1)) == 0,
+                "Slabs are found by masking, so their size is a power of 2.");
+
+  struct SlabHeader {
+    unsigned node;
+  };
+  // Blocks start this far into a slab, keeping them aligned.
+  static constexpr std::size_t kSlabHeaderSize =
+      (sizeof(SlabHeader) + Align - 1) & ~(Align - 1);
+
+  FixedSizePool() = default;
+
+  static unsigned NodeOf(const void *block) {
+    const std::uintptr_t slab =
+        reinterpret_cast<std::uintptr_t>(block) & ~(kSlabSize - 1);
+    return reinterpret_cast<const SlabHeader *>(slab)->node;
+  }
+
+  // Null once the calling thread's cache has been torn down; flags released
+  // by later thread_local destructors then go through the shared list.
+  static ThreadCache *LocalCache() {
+    thread_local CacheState state = CacheState::kUnset;
+    if (state == CacheState::kDead)
+      return nullptr;
+    thread_local ThreadCache cache(&state);
+    return &cache;
+  }
+
+  void Attach(ThreadCache *cache) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    caches_.push_back(cache);
+  }
+
+  void Detach(ThreadCache *cache) {
+    Spill(cache, cache->count);
+    std::lock_guard<std::mutex> lock(mutex_);
+    retired_.allocations += cache->allocations.load(std::memory_order_relaxed);
+    retired_.frees += cache->frees.load(std::memory_order_relaxed);
+    retired_.reused += cache->reused.load(std::memory_order_relaxed);
+    for (auto it = caches_.begin(); it != caches_.end(); ++it) {
+      if (*it == cache) {
+        caches_.erase(it);
+        break;
+      }
+    }
+  }
+
+  void Refill(ThreadCache *cache) {
+    NodeFreeList &list = free_lists_[CurrentNumaNode()];
+    std::lock_guard<std::mutex> lock(list.mutex);
+    while (list.head && cache->count < kBatch) {
+      FreeBlock *block = list.head;
+      list.head = block->next;
+      block->next = cache->head;
+      cache->head = block;
+      ++cache->count;
+    }
+  }
+
+  // Sorts the first |count| cached blocks by home node, then hands each
+  // node's share over under that node's mutex.
+  void Spill(ThreadCache *cache, std::size_t count) {
+    FreeBlock *first[kMaxNumaNodes] = {};
+    FreeBlock *last[kMaxNumaNodes] = {};
+    cache->count -= count;
+    for (; count; --count) {
+      FreeBlock *block = cache->head;
+      cache->head = block->next;
+      const unsigned node = NodeOf(block);
+      if (!first[node])
+        last[node] = block;
+      block->next = first[node];
+      first[node] = block;
+    }
+    for (unsigned node = 0; node < kMaxNumaNodes; ++node) {
+      if (!first[node])
+        continue;
+      NodeFreeList &list = free_lists_[node];
+      std::lock_guard<std::mutex> lock(list.mutex);
+      last[node]->next = list.head;
+      list.head = first[node];
+    }
+  }
+
+  void NewSlab(ThreadCache *cache) {
+    char *slab;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slab = TakeSlab();
+    }
+    StartSlab(slab, &cache->cursor, &cache->end);
+  }
+
+  // The next aligned slab of the current chunk, under mutex_. Chunks are
+  // never freed either, so their base pointers aren't kept.
+  char *TakeSlab() {
+    if (chunk_cursor_ == chunk_end_) {
+      const std::size_t size = (kSlabsPerChunk + 1) * kSlabSize;
+      const std::uintptr_t raw =
+          reinterpret_cast<std::uintptr_t>(::operator new(size));
+      bytes_reserved_ += size;
+      chunk_cursor_ = reinterpret_cast<char *>((raw + kSlabSize - 1) &
+                                               ~(kSlabSize - 1));
+      chunk_end_ = chunk_cursor_ + kSlabsPerChunk * kSlabSize;
+    }
+    char *slab = chunk_cursor_;
+    chunk_cursor_ += kSlabSize;
+    return slab;
+  }
+
+  // Writing the header faults the first page in, so the node lookup sees
+  // where it really is. Blocks further in may sit on other pages; the first
+  // one stands for the slab.
+  static void StartSlab(char *slab, char **cursor, char **end) {
+    SlabHeader *header = ::new (static_cast<void *>(slab)) SlabHeader;
+    header->node = 0;
+    header->node = NumaNodeOf(slab);
+    *cursor = slab + kSlabHeaderSize;
+    *end = *cursor + (kSlabSize - kSlabHeaderSize) / kBlockSize * kBlockSize;
+  }
+
+  void *AllocateShared() {
+    {
+      NodeFreeList &list = free_lists_[CurrentNumaNode()];
+      std::lock_guard<std::mutex> lock(list.mutex);
+      if (FreeBlock *block = list.head) {
+        list.head = block->next;
+        std::lock_guard<std::mutex> stats_lock(mutex_);
+        ++retired_.allocations;
+        ++retired_.reused;
+        return block;
+      }
+    }
+    // Carved from a slab shared by every thread without a cache, so these
+    // blocks find their node like all others.
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++retired_.allocations;
+    if (shared_cursor_ == shared_end_)
+      StartSlab(TakeSlab(), &shared_cursor_, &shared_end_);
+    void *block = shared_cursor_;
+    shared_cursor_ += kBlockSize;
+    return block;
+  }
+
+  // Guarded by mutex_.
+  char *chunk_cursor_ = nullptr;
+  char *chunk_end_ = nullptr;
+  char *shared_cursor_ = nullptr;
+  char *shared_end_ = nullptr;
+};
+
+} // namespace internal
+
+// Allocator for weak pointer flags, see the Allocator parameter of
+// WeakPtrFactory/SupportsWeakPtr. Stateless: every instance shares the
+// per-size-class pools.
+template <typename T> class PooledFlagAllocator {
+public:
+  using value_type = T;
+
+  template <typename U> struct rebind { using other = PooledFlagAllocator<U>; };
+
+  PooledFlagAllocator() = default;
+  template <typename U> PooledFlagAllocator(const PooledFlagAllocator<U> &) {}
+
+  T *allocate(std::size_t n) {
+    assert(n == 1);
+    (void)n;
+    return static_cast<T *>(Pool<T>::Get().Allocate());
+  }
+  void deallocate(T *ptr, std::size_t) { Pool<T>::Get().Deallocate(ptr); }
+
+  template <typename U> bool operator==(const PooledFlagAllocator<U> &) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const PooledFlagAllocator<U> &) const {
+    return false;
+  }
+
+private:
+  // A template so PooledFlagAllocator<void> can be named before rebinding.
+  template <typename U>
+  using Pool = internal::FixedSizePool<sizeof(U), alignof(U)>;
+};
+
+// PooledFlagAllocator with the cache-line flag layout: every flag starts on a
+// cache line of its own and is padded to whole lines, with the threading
+// checker's state on a separate line behind the reference count and validity
+// bits. Costs at least 64 bytes per flag instead of about 40; worth it for
+// flags that threads on different cores hammer side by side. The per-node
+// free lists apply as for PooledFlagAllocator.
+//
+// 64 bytes rather than std::hardware_destructive_interference_size, which is
+// C++17 and not ABI-stable across compiler flags.
+template <typename T>
+class CacheAlignedFlagAllocator : public PooledFlagAllocator<T> {
+public:
+  static constexpr bool kCacheLineFlagLayout = true;
+
+  template <typename U> struct rebind {
+    using other = CacheAlignedFlagAllocator<U>;
+  };
+
+  CacheAlignedFlagAllocator() = default;
+  template <typename U>
+  CacheAlignedFlagAllocator(const CacheAlignedFlagAllocator<U> &) {}
+};
+
+template <typename T>
+constexpr bool CacheAlignedFlagAllocator<T>::kCacheLineFlagLayout;
+
+// Sums the stats of every pooled size class.
+inline FlagPoolStats GetFlagPoolStats() {
+  FlagPoolStats stats;
+  internal::FlagPoolRegistry::Get().ForEach(
+      [&](internal::FlagPoolBase &pool) { pool.AddStats(&stats); });
+  return stats;
+}
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_FLAG_POOL_INCLUDE_H_
@@ -0,0 +1,274 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_GENERATIONAL_WEAK_PTR_INCLUDE_H_
+#define XLIB_BASE_GENERATIONAL_WEAK_PTR_INCLUDE_H_
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace xcpp {
+
+template <typename E> class SlotArena;
+
+namespace internal {
+
+// A handle's 32-bit index is the arena id in the top kArenaBits and the slot
+// in the rest, so 256 arenas of 16M slots per element type.
+constexpr unsigned kArenaBits = 8;
+constexpr unsigned kSlotBits = 32 - kArenaBits;
+constexpr std::uint32_t kMaxArenas = 1u << kArenaBits;
+constexpr std::uint32_t kMaxSlots = 1u << kSlotBits;
+
+// Maps arena ids to the live arenas of element type E. An id is reusable once
+// its arena is gone: the next arena with that id starts its generations above
+// every generation the previous one issued, so old handles never match.
+template <typename E> class SlotArenaRegistry {
+public:
+  // Constant-initialized, so get() pays no guard for it.
+  static SlotArenaRegistry &Get() { return instance_; }
+
+  // Returns the id and sets |*first_generation|; asserts if every id is in
+  // use or retired.
+  std::uint32_t Register(SlotArena<E> *arena,
+                         std::uint32_t *first_generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::uint32_t id = 0; id < kMaxArenas; ++id) {
+      if (arenas_[id].load(std::memory_order_relaxed) || retired_[id])
+        continue;
+      *first_generation = floors_[id] | 1;
+      arenas_[id].store(arena, std::memory_order_release);
+      return id;
+    }
+    assert(false && "Too many SlotArenas of one element type.");
+    std::abort();
+  }
+
+  // |next_generation| is one above the largest generation the arena issued,
+  // or 0 if it ran out of generations.
+  void Unregister(std::uint32_t id, std::uint32_t next_generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    arenas_[id].store(nullptr, std::memory_order_release);
+    if (next_generation == 0)
+      retired_[id] = true;
+    else
+      floors_[id] = next_generation;
+  }
+
+  SlotArena<E> *Find(std::uint32_t id) const {
+    return arenas_[id].load(std::memory_order_acquire);
+  }
+
+private:
+  constexpr SlotArenaRegistry() = default;
+
+  static SlotArenaRegistry instance_;
+
+  // All zero-initialized: no arena, generations start at 1.
+  std::mutex mutex_;
+  std::atomic<SlotArena<E> *> arenas_[kMaxArenas] = {};
+  std::uint32_t floors_[kMaxArenas] = {};
+  bool retired_[kMaxArenas] = {};
+};
+
+template <typename E> SlotArenaRegistry<E> SlotArenaRegistry<E>::instance_;
+
+} // namespace internal
+
+// A weak reference into a SlotArena<E>: 32-bit index plus 32-bit generation,
+// no control block. It is valid while the slot still holds the object it was
+// created for, checked by comparing generations. T is E or a base of E; the
+// E parameter keeps the arena lookup typed so views of bases need no offset.
+//
+// Like WeakPtr, get() is only meaningful on the arena's sequence.
+template <typename T, typename E = std::remove_cv_t<T>>
+class GenerationalWeakPtr {
+  static_assert(std::is_convertible<E *, T *>::value,
+                "T must be E or an accessible base of E.");
+
+public:
+  GenerationalWeakPtr() = default;
+  GenerationalWeakPtr(std::nullptr_t) {}
+
+  // Same rule as WeakPtr's implicit conversions: U* has to convert to T*.
+  template <typename U,
+            typename = std::enable_if_t<std::is_convertible<U *, T *>::value>>
+  GenerationalWeakPtr(const GenerationalWeakPtr<U, E> &other)
+      : index_(other.index_), generation_(other.generation_) {}
+
+  T *get() const {
+    if (!generation_)
+      return nullptr;
+    SlotArena<E> *arena = internal::SlotArenaRegistry<E>::Get().Find(
+        index_ >> internal::kSlotBits);
+    if (!arena)
+      return nullptr;
+    return arena->Find(index_ & (internal::kMaxSlots - 1), generation_);
+  }
+
+  T &operator*() const {
+    assert(get() != nullptr);
+    return *get();
+  }
+  T *operator->() const {
+    assert(get() != nullptr);
+    return get();
+  }
+  explicit operator bool() const { return get() != nullptr; }
+
+  void reset() {
+    index_ = 0;
+    generation_ = 0;
+  }
+  bool is_null() const { return !get(); }
+
+  // Identity, without looking the slot up.
+  bool operator==(const GenerationalWeakPtr &other) const {
+    return index_ == other.index_ && generation_ == other.generation_;
+  }
+  bool operator!=(const GenerationalWeakPtr &other) const {
+    return !(*this == other);
+  }
+
+  std::uint64_t ToInternalValue() const {
+    return static_cast<std::uint64_t>(index_) << 32 | generation_;
+  }
+
+private:
+  template <typename U, typename V> friend class GenerationalWeakPtr;
+  friend class SlotArena<E>;
+
+  GenerationalWeakPtr(std::uint32_t index, std::uint32_t generation)
+      : index_(index), generation_(generation) {}
+
+  std::uint32_t index_ = 0;
+  // Odd for live objects, so 0 never matches.
+  std::uint32_t generation_ = 0;
+};
+
+static_assert(sizeof(GenerationalWeakPtr<int>) == 8,
+              "GenerationalWeakPtr must stay 8 bytes.");
+
+// A slot map for objects of type E. Objects live in fixed chunks, so they
+// never move; freed slots are recycled with a bumped generation, which
+// invalidates every handle to the previous occupant. Destroying the arena
+// destroys the remaining objects and invalidates all handles.
+//
+// Not thread-safe; use it on one sequence.
+template <typename E> class SlotArena {
+public:
+  using Handle = GenerationalWeakPtr<E, E>;
+
+  SlotArena() {
+    id_ = internal::SlotArenaRegistry<E>::Get().Register(this,
+                                                         &first_generation_);
+  }
+  ~SlotArena() {
+    std::uint32_t next_generation = first_generation_;
+    bool wrapped = false;
+    for (std::uint32_t slot = 0; slot < used_; ++slot) {
+      Slot &entry = At(slot);
+      if (entry.generation & 1)
+        entry.object()->~E();
+      const std::uint32_t next = entry.generation + 1;
+      if (entry.generation == 0 || next == 0)
+        wrapped = true;
+      else if (next > next_generation)
+        next_generation = next;
+    }
+    internal::SlotArenaRegistry<E>::Get().Unregister(
+        id_, wrapped ? 0 : next_generation);
+  }
+
+  template <typename... Args> Handle New(Args &&... args) {
+    std::uint32_t slot;
+    if (free_ != kNoSlot) {
+      slot = free_;
+      free_ = At(slot).next_free;
+    } else {
+      assert(used_ < internal::kMaxSlots);
+      if (used_ == chunks_.size() * kChunkSize)
+        chunks_.emplace_back(new Slot[kChunkSize]);
+      slot = used_++;
+      At(slot).generation = first_generation_ - 1;
+    }
+    Slot &entry = At(slot);
+    ::new (static_cast<void *>(&entry.storage)) E(std::forward<Args>(args)...);
+    ++entry.generation;
+    ++size_;
+    return Handle(id_ << internal::kSlotBits | slot, entry.generation);
+  }
+
+  // Destroys the object |handle| refers to. Returns false for stale handles.
+  template <typename T> bool Delete(const GenerationalWeakPtr<T, E> &handle) {
+    if (handle.index_ >> internal::kSlotBits != id_ || !handle.generation_)
+      return false;
+    const std::uint32_t slot = handle.index_ & (internal::kMaxSlots - 1);
+    if (!Find(slot, handle.generation_))
+      return false;
+    Slot &entry = At(slot);
+    entry.object()->~E();
+    --size_;
+    // A slot whose generation wraps is retired instead of reused.
+    if (++entry.generation != 0) {
+      entry.next_free = free_;
+      free_ = slot;
+    }
+    return true;
+  }
+
+  E *Find(std::uint32_t slot, std::uint32_t generation) {
+    if (slot >= used_)
+      return nullptr;
+    Slot &entry = At(slot);
+    return entry.generation == generation ? entry.object() : nullptr;
+  }
+
+  std::size_t size() const { return size_; }
+
+private:
+  SlotArena(const SlotArena &) = delete;
+  SlotArena &operator=(const SlotArena &) = delete;
+
+  static constexpr std::uint32_t kChunkShift = 10;
+  static constexpr std::uint32_t kChunkSize = 1u << kChunkShift;
+  static constexpr std::uint32_t kNoSlot = ~0u;
+
+  struct Slot {
+    // Odd while occupied.
+    std::uint32_t generation;
+    std::uint32_t next_free;
+    std::aligned_storage_t<sizeof(E), alignof(E)> storage;
+
+    E *object() { return reinterpret_cast<E *>(&storage); }
+  };
+
+  Slot &At(std::uint32_t slot) {
+    return chunks_[slot >> kChunkShift][slot & (kChunkSize - 1)];
+  }
+
+  std::vector<std::unique_ptr<Slot[]>> chunks_;
+  std::uint32_t used_ = 0;
+  std::uint32_t free_ = kNoSlot;
+  std::size_t size_ = 0;
+  std::uint32_t id_ = 0;
+  std::uint32_t first_generation_ = 1;
+};
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_GENERATIONAL_WEAK_PTR_INCLUDE_H_
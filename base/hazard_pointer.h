@@ -0,0 +1,161 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_HAZARD_POINTER_INCLUDE_H_
+#define XLIB_BASE_HAZARD_POINTER_INCLUDE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <thread>
+
+namespace xcpp {
+
+namespace internal {
+
+constexpr std::size_t kHazardCacheLineSize = 64;
+constexpr std::size_t kHazardSlotsPerThread = 4;
+
+// The hazard slots of one thread, alone on its cache line so protecting a
+// pointer never writes a line another reader touches.
+struct HazardRecord {
+  std::atomic<const void *> slots[kHazardSlotsPerThread];
+  std::atomic<bool> in_use;
+  HazardRecord *next;
+};
+
+static_assert(sizeof(HazardRecord) <= kHazardCacheLineSize,
+              "A hazard record must fit in one cache line.");
+
+// Process-wide list of hazard records. Records are recycled when their thread
+// exits and never freed, so scanners can walk the list without locking.
+class HazardDomain {
+public:
+  static HazardDomain &Get() {
+    static HazardDomain *domain = new HazardDomain;
+    return *domain;
+  }
+
+  HazardRecord *AcquireRecord() {
+    for (HazardRecord *record = head_.load(std::memory_order_acquire); record;
+         record = record->next) {
+      bool expected = false;
+      if (!record->in_use.load(std::memory_order_relaxed) &&
+          record->in_use.compare_exchange_strong(expected, true,
+                                                 std::memory_order_acquire))
+        return record;
+    }
+    // The push is seq_cst, like the scan's load of head_ below: a record
+    // pushed concurrently with an invalidation is then either seen by the
+    // scan or publishes its slot after the invalidation, and fails to
+    // re-validate.
+    HazardRecord *record = NewRecord();
+    HazardRecord *head = head_.load(std::memory_order_relaxed);
+    do {
+      record->next = head;
+    } while (!head_.compare_exchange_weak(head, record,
+                                          std::memory_order_seq_cst,
+                                          std::memory_order_relaxed));
+    return record;
+  }
+
+  void ReleaseRecord(HazardRecord *record) {
+    record->in_use.store(false, std::memory_order_release);
+  }
+
+  // Returns once no slot protects |ptr|. The caller must have made |ptr|
+  // unreachable for new readers with a seq_cst operation first; readers
+  // publish their slot with seq_cst and then re-validate.
+  void WaitUntilUnprotected(const void *ptr) const {
+    for (HazardRecord *record = head_.load(std::memory_order_seq_cst); record;
+         record = record->next) {
+      for (auto &slot : record->slots) {
+        while (slot.load(std::memory_order_seq_cst) == ptr)
+          std::this_thread::yield();
+      }
+    }
+  }
+
+private:
+  HazardDomain() = default;
+
+  static HazardRecord *NewRecord() {
+    // Records live forever, so the unaligned base pointer isn't kept.
+    void *raw = ::operator new(sizeof(HazardRecord) + kHazardCacheLineSize);
+    const std::uintptr_t aligned =
+        (reinterpret_cast<std::uintptr_t>(raw) + kHazardCacheLineSize - 1) &
+        ~(kHazardCacheLineSize - 1);
+    HazardRecord *record = ::new (reinterpret_cast<void *>(aligned))
+        HazardRecord;
+    for (auto &slot : record->slots)
+      slot.store(nullptr, std::memory_order_relaxed);
+    record->in_use.store(true, std::memory_order_relaxed);
+    record->next = nullptr;
+    return record;
+  }
+
+  std::atomic<HazardRecord *> head_{nullptr};
+};
+
+// The calling thread's hazard record, acquired on first use and handed back
+// to the domain when the thread exits.
+class ThreadHazards {
+public:
+  using Slot = std::atomic<const void *>;
+
+  // Publishes |ptr| in a free slot of the calling thread. Returns null when
+  // all slots are taken (deep nesting) or the thread is shutting down.
+  static Slot *Protect(const void *ptr) {
+    HazardRecord *record = LocalRecord();
+    if (!record)
+      return nullptr;
+    for (auto &slot : record->slots) {
+      if (slot.load(std::memory_order_relaxed))
+        continue;
+      slot.store(ptr, std::memory_order_seq_cst);
+      return &slot;
+    }
+    return nullptr;
+  }
+
+  static void Clear(Slot *slot) {
+    slot->store(nullptr, std::memory_order_release);
+  }
+
+private:
+  enum class State : unsigned char { kUnset, kLive, kDead };
+
+  struct Holder {
+    explicit Holder(State *state)
+        : state(state), record(HazardDomain::Get().AcquireRecord()) {
+      *state = State::kLive;
+    }
+    ~Holder() {
+      HazardDomain::Get().ReleaseRecord(record);
+      *state = State::kDead;
+    }
+
+    State *state;
+    HazardRecord *record;
+  };
+
+  static HazardRecord *LocalRecord() {
+    thread_local State state = State::kUnset;
+    if (state == State::kDead)
+      return nullptr;
+    thread_local Holder holder(&state);
+    return holder.record;
+  }
+};
+
+} // namespace internal
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_HAZARD_POINTER_INCLUDE_H_
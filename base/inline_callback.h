@@ -0,0 +1,138 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_INLINE_CALLBACK_INCLUDE_H_
+#define XLIB_BASE_INLINE_CALLBACK_INCLUDE_H_
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace xcpp {
+
+// Enough for a method pointer, a WeakPtr and four pointer-sized arguments.
+constexpr std::size_t kInlineCallbackCapacity = 8 * sizeof(void *);
+
+template <typename Signature,
+          std::size_t Capacity = kInlineCallbackCapacity>
+class InlineCallback;
+
+// A move-only std::function replacement that stores callables of up to
+// |Capacity| bytes in place. Larger or throwing-move callables go to the heap
+// like they would with std::function. May be invoked any number of times.
+template <typename R, typename... Args, std::size_t Capacity>
+class InlineCallback<R(Args...), Capacity> {
+public:
+  InlineCallback() = default;
+  InlineCallback(std::nullptr_t) {}
+
+  template <typename F, typename Functor = std::decay_t<F>,
+            typename = std::enable_if_t<
+                !std::is_same<Functor, InlineCallback>::value>>
+  InlineCallback(F &&functor) {
+    Init<Functor>(std::forward<F>(functor), FitsInline<Functor>());
+  }
+
+  InlineCallback(InlineCallback &&other) noexcept : ops_(other.ops_) {
+    if (ops_)
+      ops_->move(&other.storage_, &storage_);
+    other.ops_ = nullptr;
+  }
+  InlineCallback &operator=(InlineCallback &&other) noexcept {
+    if (this != &other) {
+      reset();
+      ops_ = other.ops_;
+      if (ops_)
+        ops_->move(&other.storage_, &storage_);
+      other.ops_ = nullptr;
+    }
+    return *this;
+  }
+  ~InlineCallback() { reset(); }
+
+  R operator()(Args... args) const {
+    assert(ops_);
+    return ops_->invoke(&storage_, std::forward<Args>(args)...);
+  }
+
+  explicit operator bool() const { return ops_ != nullptr; }
+
+  // False for empty callbacks and for callables that spilled to the heap.
+  bool is_inline() const { return ops_ && ops_->is_inline; }
+
+  void reset() {
+    if (ops_)
+      ops_->destroy(&storage_);
+    ops_ = nullptr;
+  }
+
+private:
+  InlineCallback(const InlineCallback &) = delete;
+  InlineCallback &operator=(const InlineCallback &) = delete;
+
+  using Storage = std::aligned_storage_t<Capacity, alignof(std::max_align_t)>;
+
+  struct Ops {
+    R (*invoke)(void *storage, Args &&... args);
+    // Move-constructs into |to| and destroys |from|.
+    void (*move)(void *from, void *to);
+    void (*destroy)(void *storage);
+    bool is_inline;
+  };
+
+  template <typename F>
+  using FitsInline = std::integral_constant<
+      bool, sizeof(F) <= Capacity &&
+                alignof(F) <= alignof(std::max_align_t) &&
+                std::is_nothrow_move_constructible<F>::value>;
+
+  template <typename F> struct InlineOps {
+    static R Invoke(void *storage, Args &&... args) {
+      return (*static_cast<F *>(storage))(std::forward<Args>(args)...);
+    }
+    static void Move(void *from, void *to) {
+      F *functor = static_cast<F *>(from);
+      ::new (to) F(std::move(*functor));
+      functor->~F();
+    }
+    static void Destroy(void *storage) { static_cast<F *>(storage)->~F(); }
+  };
+
+  template <typename F> struct HeapOps {
+    static F *&Get(void *storage) { return *static_cast<F **>(storage); }
+    static R Invoke(void *storage, Args &&... args) {
+      return (*Get(storage))(std::forward<Args>(args)...);
+    }
+    static void Move(void *from, void *to) {
+      ::new (to) F *(Get(from));
+    }
+    static void Destroy(void *storage) { delete Get(storage); }
+  };
+
+  template <typename F, typename G> void Init(G &&functor, std::true_type) {
+    static constexpr Ops kOps = {&InlineOps<F>::Invoke, &InlineOps<F>::Move,
+                                 &InlineOps<F>::Destroy, true};
+    ::new (static_cast<void *>(&storage_)) F(std::forward<G>(functor));
+    ops_ = &kOps;
+  }
+  template <typename F, typename G> void Init(G &&functor, std::false_type) {
+    static constexpr Ops kOps = {&HeapOps<F>::Invoke, &HeapOps<F>::Move,
+                                 &HeapOps<F>::Destroy, false};
+    ::new (static_cast<void *>(&storage_)) F *(new F(std::forward<G>(functor)));
+    ops_ = &kOps;
+  }
+
+  mutable Storage storage_;
+  const Ops *ops_ = nullptr;
+};
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_INLINE_CALLBACK_INCLUDE_H_
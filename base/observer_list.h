@@ -0,0 +1,151 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_OBSERVER_LIST_INCLUDE_H_
+#define XLIB_BASE_OBSERVER_LIST_INCLUDE_H_
+
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "base/weak_ptr.h"
+
+namespace xcpp {
+
+// A list of weakly held observers. Flags and observer addresses are kept in
+// two parallel arrays, so dropping dead entries is one linear pass over the
+// flags and notifying is one linear pass over the addresses.
+//
+// ForEach() compacts first, then checks each entry's flag once more right
+// before notifying it, so an observer invalidated or destroyed by an earlier
+// callback of the same pass is skipped. Observers may be added or removed
+// from inside a notification: additions are not visited by the running pass,
+// removals and invalidations are skipped and compacted once the outermost
+// pass ends.
+//
+// Not thread-safe; use it on the sequence its observers live on.
+template <typename Observer> class WeakObserverList {
+public:
+  WeakObserverList() = default;
+  ~WeakObserverList() { assert(!iteration_depth_); }
+
+  void AddObserver(const WeakPtr<Observer> &observer) {
+    if (!observer)
+      return;
+    flags_.push_back(internal::WeakPtrAccess::GetFlag(observer));
+    observers_.push_back(observer.get());
+  }
+
+  void RemoveObserver(const Observer *observer) {
+    for (std::size_t i = 0; i < observers_.size(); ++i) {
+      if (observers_[i] != observer)
+        continue;
+      if (iteration_depth_) {
+        observers_[i] = nullptr;
+        needs_compact_ = true;
+      } else {
+        EraseAt(i);
+      }
+      return;
+    }
+  }
+
+  bool HasObserver(const Observer *observer) const {
+    for (std::size_t i = 0; i < observers_.size(); ++i) {
+      if (observers_[i] == observer && flags_[i].IsValid())
+        return true;
+    }
+    return false;
+  }
+
+  // Drops invalidated and removed entries, keeping the order of the others.
+  // Deferred while a notification is running.
+  void Compact() {
+    if (iteration_depth_) {
+      needs_compact_ = true;
+      return;
+    }
+    constexpr std::size_t kPrefetchDistance = 8;
+    const std::size_t size = flags_.size();
+    std::size_t live = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+#if defined(__GNUC__) || defined(__clang__)
+      if (i + kPrefetchDistance < size)
+        __builtin_prefetch(flags_[i + kPrefetchDistance].get());
+#endif
+      if (!observers_[i] || !flags_[i].IsValid())
+        continue;
+      if (live != i) {
+        flags_[live] = std::move(flags_[i]);
+        observers_[live] = observers_[i];
+      }
+      ++live;
+    }
+    flags_.resize(live);
+    observers_.resize(live);
+    needs_compact_ = false;
+  }
+
+  template <typename Function> void ForEach(Function &&function) {
+    Compact();
+    ++iteration_depth_;
+    const std::size_t end = observers_.size();
+    for (std::size_t i = 0; i < end; ++i) {
+      // Re-read on every step: |function| may append and reallocate.
+      Observer *observer = observers_[i];
+      if (!observer)
+        continue;
+      if (!flags_[i].IsValid()) {
+        needs_compact_ = true;
+        continue;
+      }
+      function(*observer);
+    }
+    if (--iteration_depth_ == 0 && needs_compact_)
+      Compact();
+  }
+
+  template <typename Method, typename... Args>
+  void Notify(Method method, Args &&... args) {
+    ForEach([&](Observer &observer) { (observer.*method)(args...); });
+  }
+
+  void Clear() {
+    if (iteration_depth_) {
+      for (auto &observer : observers_)
+        observer = nullptr;
+      needs_compact_ = true;
+      return;
+    }
+    flags_.clear();
+    observers_.clear();
+  }
+
+  // Number of entries, including dead ones not compacted yet.
+  std::size_t size() const { return observers_.size(); }
+  bool empty() const { return observers_.empty(); }
+
+private:
+  WeakObserverList(const WeakObserverList &) = delete;
+  WeakObserverList &operator=(const WeakObserverList &) = delete;
+
+  void EraseAt(std::size_t index) {
+    flags_.erase(flags_.begin() + index);
+    observers_.erase(observers_.begin() + index);
+  }
+
+  std::vector<internal::FlagRef> flags_;
+  std::vector<Observer *> observers_;
+  int iteration_depth_ = 0;
+  bool needs_compact_ = false;
+};
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_OBSERVER_LIST_INCLUDE_H_
@@ -0,0 +1,78 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_SEQUENCE_TOKEN_INCLUDE_H_
+#define XLIB_BASE_SEQUENCE_TOKEN_INCLUDE_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace xcpp {
+
+// Identifies a sequence of tasks independently of the OS thread running them.
+// Executors create one token per sequence and install it with
+// ScopedSetSequenceToken while they run that sequence's tasks; a thread that
+// never had a token installed is its own sequence.
+class SequenceToken {
+public:
+  SequenceToken() = default;
+
+  static SequenceToken Create() {
+    static std::atomic<std::uint64_t> next_token{1};
+    return SequenceToken(next_token.fetch_add(1, std::memory_order_relaxed));
+  }
+
+  static SequenceToken GetForCurrentThread() {
+    std::uint64_t &current = Current();
+    if (!current)
+      current = Create().token_;
+    return SequenceToken(current);
+  }
+
+  bool IsValid() const { return token_ != 0; }
+  std::uint64_t ToInternalValue() const { return token_; }
+
+  bool operator==(const SequenceToken &other) const {
+    return token_ == other.token_;
+  }
+  bool operator!=(const SequenceToken &other) const {
+    return token_ != other.token_;
+  }
+
+private:
+  friend class ScopedSetSequenceToken;
+
+  explicit SequenceToken(std::uint64_t token) : token_(token) {}
+
+  static std::uint64_t &Current() {
+    thread_local std::uint64_t current = 0;
+    return current;
+  }
+
+  std::uint64_t token_ = 0;
+};
+
+// Makes |token| the current sequence of the calling thread for its scope.
+class ScopedSetSequenceToken {
+public:
+  explicit ScopedSetSequenceToken(const SequenceToken &token)
+      : previous_(SequenceToken::Current()) {
+    SequenceToken::Current() = token.token_;
+  }
+  ~ScopedSetSequenceToken() { SequenceToken::Current() = previous_; }
+
+private:
+  ScopedSetSequenceToken(const ScopedSetSequenceToken &) = delete;
+  ScopedSetSequenceToken &operator=(const ScopedSetSequenceToken &) = delete;
+
+  const std::uint64_t previous_;
+};
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_SEQUENCE_TOKEN_INCLUDE_H_
@@ -12,64 +12,101 @@
 #include <cstdint>
 #include <type_traits>
 
+namespace uintptr_cast_internal {
+
+// Pointer conversions are picked at compile time: identity for the same type,
+// static_cast for public unambiguous upcasts and dynamic_cast only for
+// downcasts and cross-casts. None of them throws: dynamic_cast of a pointer
+// yields null instead, so every uintptr_cast is noexcept.
+struct identity_tag {};
+struct upcast_tag {};
+struct dynamic_tag {};
+
+template <typename From, typename To>
+using cast_tag = typename std::conditional<
+    std::is_same<typename std::remove_cv<From>::type,
+                 typename std::remove_cv<To>::type>::value,
+    identity_tag,
+    typename std::conditional<
+        std::is_convertible<const From*, const To*>::value, upcast_tag,
+        dynamic_tag>::type>::type;
+
+template <typename From, typename To>
+inline std::uintptr_t cast(const From* from, identity_tag) noexcept {
+  return reinterpret_cast<std::uintptr_t>(from);
+}
+
+template <typename From, typename To>
+inline std::uintptr_t cast(const From* from, upcast_tag) noexcept {
+  return reinterpret_cast<std::uintptr_t>(static_cast<const To*>(from));
+}
+
+template <typename From, typename To>
+inline std::uintptr_t cast(const From* from, dynamic_tag) noexcept {
+  return reinterpret_cast<std::uintptr_t>(dynamic_cast<const To*>(from));
+}
+
+} // namespace uintptr_cast_internal
+
 template <typename From, typename To,
           typename std::enable_if<std::is_void<From>::value &&
                                   std::is_void<To>::value>::type* = nullptr>
-std::uintptr_t uintptr_cast(const std::uintptr_t& ptr) {
+constexpr std::uintptr_t uintptr_cast(const std::uintptr_t& ptr) noexcept {
   return ptr;
 }
 
 template <typename From, typename To,
           typename std::enable_if<!std::is_void<From>::value &&
                                     !std::is_void<To>::value>::type* = nullptr>
-std::uintptr_t uintptr_cast(const std::uintptr_t& ptr) {
-  if (std::is_same<From, To>::value) {
-    return ptr;
-  }
-  auto from = reinterpret_cast<From*>(ptr);
-  auto to = dynamic_cast<To*>(from);
-  return reinterpret_cast<std::uintptr_t>(to);
+std::uintptr_t uintptr_cast(const std::uintptr_t& ptr) noexcept {
+  return uintptr_cast_internal::cast<From, To>(
+      reinterpret_cast<const From*>(ptr),
+      uintptr_cast_internal::cast_tag<From, To>());
 }
 
 template <typename From, typename To,
           typename std::enable_if<std::is_void<From>::value &&
                                     !std::is_void<To>::value>::type* = nullptr>
-std::uintptr_t uintptr_cast(const std::uintptr_t& ptr) {
+constexpr std::uintptr_t uintptr_cast(const std::uintptr_t& ptr) noexcept {
   return ptr;
 }
 
 template <typename From, typename To,
           typename std::enable_if<!std::is_void<From>::value &&
                                     std::is_void<To>::value>::type* = nullptr>
-std::uintptr_t uintptr_cast(const std::uintptr_t& ptr) {
+constexpr std::uintptr_t uintptr_cast(const std::uintptr_t& ptr) noexcept {
   return ptr;
 }
 
 template <typename From, typename To,
           typename std::enable_if<!std::is_void<From>::value &&
                                   !std::is_void<To>::value>::type* = nullptr>
-std::uintptr_t uintptr_cast(const From* from) {
-  if (std::is_same<From, To>::value) {
-    return reinterpret_cast<std::uintptr_t>(from);
-  }
-  auto to = dynamic_cast<To*>(from);
-  return reinterpret_cast<std::uintptr_t>(to);
+std::uintptr_t uintptr_cast(const From* from) noexcept {
+  return uintptr_cast_internal::cast<From, To>(
+      from, uintptr_cast_internal::cast_tag<From, To>());
 }
 
 template <typename From, typename To,
           typename std::enable_if<std::is_void<From>::value ||
                                   std::is_void<To>::value>::type* = nullptr>
-std::uintptr_t uintptr_cast(const From* from) {
+std::uintptr_t uintptr_cast(const From* from) noexcept {
   return reinterpret_cast<std::uintptr_t>(from);
 }
 
-inline std::uintptr_t uintptr_cast(const void* from) {
+inline std::uintptr_t uintptr_cast(const void* from) noexcept {
   return reinterpret_cast<std::uintptr_t>(from);
 }
 
 template <typename To>
-const To uintptr_cast(const std::uintptr_t& ptr) {
+const To uintptr_cast(const std::uintptr_t& ptr) noexcept {
   return reinterpret_cast<To>(ptr);
 }
 
+// Conversions involving void are plain integer copies, usable in constant
+// expressions.
+static_assert(uintptr_cast<void, void>(std::uintptr_t(8)) == 8,
+              "void to void must be the identity.");
+static_assert(noexcept(uintptr_cast<int, int>(std::uintptr_t(0))),
+              "uintptr_cast must not throw.");
+
 #endif // !XLIB_BASE_UINTPTR_CAST_INCLUDE_H_
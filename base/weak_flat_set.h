@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_WEAK_FLAT_SET_INCLUDE_H_
+#define XLIB_BASE_WEAK_FLAT_SET_INCLUDE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "base/weak_ptr.h"
+
+namespace xcpp {
+
+// A sorted vector of WeakPtrs, ordered by WeakPtrIdentityLess. Searching
+// compares cached addresses only; a flag is loaded once for the candidate an
+// address search lands on. Dead entries stay in place, count towards size()
+// and are skipped by lookups until EraseExpired() drops them all in one pass.
+//
+// Iterators and the entries they point to are invalidated by every mutation.
+//
+// Not thread-safe; use it on one sequence.
+template <typename T> class WeakFlatSet {
+public:
+  using value_type = WeakPtr<T>;
+  using const_iterator = typename std::vector<WeakPtr<T>>::const_iterator;
+
+  WeakFlatSet() = default;
+  WeakFlatSet(WeakFlatSet &&) noexcept = default;
+  WeakFlatSet &operator=(WeakFlatSet &&) noexcept = default;
+
+  // Adds |weak| unless it is invalid or a live entry for the same address
+  // exists. A dead entry at that address is replaced.
+  bool Insert(const WeakPtr<T> &weak) {
+    if (!IsLive(weak))
+      return false;
+    auto range = EqualRange(Raw(weak));
+    for (auto it = range.first; it != range.second; ++it) {
+      if (IsLive(*it))
+        return false;
+    }
+    auto it = entries_.erase(range.first, range.second);
+    entries_.insert(it, weak);
+    return true;
+  }
+
+  // Adds a whole batch with one sort and one merge, e.g. when building the
+  // set initially. Invalid entries and duplicates of live entries are dropped,
+  // and so is every dead entry already in the set.
+  template <typename InputIterator>
+  void Insert(InputIterator first, InputIterator last) {
+    const std::size_t old_size = entries_.size();
+    for (; first != last; ++first) {
+      if (IsLive(*first))
+        entries_.push_back(*first);
+    }
+    auto middle = entries_.begin() + old_size;
+    std::sort(middle, entries_.end(), WeakPtrIdentityLess());
+    std::inplace_merge(entries_.begin(), middle, entries_.end(),
+                       WeakPtrIdentityLess());
+    EraseExpired();
+    entries_.erase(std::unique(entries_.begin(), entries_.end(),
+                               [](const WeakPtr<T> &lhs,
+                                  const WeakPtr<T> &rhs) {
+                                 return Raw(lhs) == Raw(rhs);
+                               }),
+                   entries_.end());
+  }
+
+  bool Contains(const T *ptr) const { return Find(ptr) != end(); }
+
+  // The live entry for |ptr|, or end().
+  const_iterator Find(const T *ptr) const {
+    auto range = std::equal_range(entries_.begin(), entries_.end(), ptr,
+                                  WeakPtrIdentityLess());
+    for (auto it = range.first; it != range.second; ++it) {
+      if (IsLive(*it))
+        return it;
+    }
+    return end();
+  }
+
+  // Removes every entry for |ptr|, live or dead.
+  bool Erase(const T *ptr) {
+    auto range = EqualRange(ptr);
+    if (range.first == range.second)
+      return false;
+    entries_.erase(range.first, range.second);
+    return true;
+  }
+
+  // Drops every entry whose object is gone, keeping the order of the others.
+  // Returns the number removed.
+  std::size_t EraseExpired() {
+    constexpr std::size_t kPrefetchDistance = 8;
+    const std::size_t size = entries_.size();
+    std::size_t live = 0;
+    for (std::size_t i = 0; i < size; ++i) {
+#if defined(__GNUC__) || defined(__clang__)
+      if (i + kPrefetchDistance < size)
+        __builtin_prefetch(
+            internal::WeakPtrAccess::GetFlag(entries_[i + kPrefetchDistance])
+                .get());
+#endif
+      if (!IsLive(entries_[i]))
+        continue;
+      if (live != i)
+        entries_[live] = std::move(entries_[i]);
+      ++live;
+    }
+    entries_.erase(entries_.begin() + live, entries_.end());
+    return size - live;
+  }
+
+  // Entries in address order, dead ones included; test with get() or
+  // operator bool as usual.
+  const_iterator begin() const { return entries_.begin(); }
+  const_iterator end() const { return entries_.end(); }
+
+  std::size_t size() const { return entries_.size(); }
+  bool empty() const { return entries_.empty(); }
+  void reserve(std::size_t capacity) { entries_.reserve(capacity); }
+  void clear() { entries_.clear(); }
+
+private:
+  WeakFlatSet(const WeakFlatSet &) = delete;
+  WeakFlatSet &operator=(const WeakFlatSet &) = delete;
+
+  using iterator = typename std::vector<WeakPtr<T>>::iterator;
+
+  static const T *Raw(const WeakPtr<T> &weak) {
+    return reinterpret_cast<const T *>(internal::WeakPtrAccess::GetRaw(weak));
+  }
+  static bool IsLive(const WeakPtr<T> &weak) {
+    return internal::WeakPtrAccess::GetFlag(weak).IsValid();
+  }
+
+  std::pair<iterator, iterator> EqualRange(const T *ptr) {
+    return std::equal_range(entries_.begin(), entries_.end(), ptr,
+                            WeakPtrIdentityLess());
+  }
+
+  std::vector<WeakPtr<T>> entries_;
+};
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_WEAK_FLAT_SET_INCLUDE_H_
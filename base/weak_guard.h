@@ -0,0 +1,217 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_WEAK_GUARD_INCLUDE_H_
+#define XLIB_BASE_WEAK_GUARD_INCLUDE_H_
+
+#include <cassert>
+#include <type_traits>
+#include <utility>
+
+#include "base/weak_ptr.h"
+
+// C++20 coroutine support for WeakPtr. Everything below needs a C++20 build;
+// in C++14 and C++17 builds the header is empty apart from its includes.
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define XLIB_HAS_WEAK_GUARD 1
+#endif
+#endif
+
+#ifdef XLIB_HAS_WEAK_GUARD
+
+#include <coroutine>
+
+namespace xcpp {
+
+// What a guarded suspension does when the owner is invalidated while the
+// coroutine waits.
+enum class WeakGuardCancel {
+  // Nothing until the wake-up arrives, which then destroys the frame.
+  kOnResume,
+  // InvalidateWeakPtrs() destroys the frames of every waiter at once, so
+  // their memory doesn't wait for wake-ups that may come late or never. The
+  // pending WeakResumers turn into no-ops.
+  kOnInvalidate,
+};
+
+// The wake-up handed to the event source of a guarded suspension, used in
+// place of a std::coroutine_handle<>. Running it resumes the coroutine if the
+// owner is still alive and destroys the frame otherwise. Dropping it without
+// running it destroys the frame as well, so a wait that never completes
+// doesn't leak. Move-only; three words.
+//
+// Run and destroy it on the owner's sequence.
+class WeakResumer {
+public:
+  WeakResumer() noexcept = default;
+  WeakResumer(WeakResumer &&other) noexcept
+      : handle_(std::exchange(other.handle_, nullptr)),
+        flag_(std::move(other.flag_)), cancel_(other.cancel_) {}
+  WeakResumer &operator=(WeakResumer &&other) noexcept {
+    WeakResumer(std::move(other)).swap(*this);
+    return *this;
+  }
+  ~WeakResumer() {
+    if (std::coroutine_handle<> handle = Take())
+      handle.destroy();
+  }
+
+  void operator()() {
+    if (std::coroutine_handle<> handle = Take()) {
+      if (flag_.IsValid())
+        handle.resume();
+      else
+        handle.destroy();
+    }
+  }
+
+  // Whether running it would still do anything.
+  explicit operator bool() const noexcept { return handle_ != nullptr; }
+
+  void swap(WeakResumer &other) noexcept {
+    std::swap(handle_, other.handle_);
+    flag_.swap(other.flag_);
+    std::swap(cancel_, other.cancel_);
+  }
+
+private:
+  template <typename T, typename Suspend> friend class WeakGuardedSuspend;
+
+  WeakResumer(std::coroutine_handle<> handle, const internal::FlagRef &flag,
+              WeakGuardCancel cancel) noexcept
+      : handle_(handle), flag_(flag), cancel_(cancel) {}
+
+  // The frame this still owns, if any. Frames of kOnInvalidate waiters whose
+  // owner is gone were destroyed by the invalidation.
+  std::coroutine_handle<> Take() noexcept {
+    std::coroutine_handle<> handle = std::exchange(handle_, nullptr);
+    if (cancel_ == WeakGuardCancel::kOnInvalidate && !flag_.IsValid())
+      return nullptr;
+    return handle;
+  }
+
+  std::coroutine_handle<> handle_;
+  internal::FlagRef flag_;
+  WeakGuardCancel cancel_ = WeakGuardCancel::kOnResume;
+};
+
+// co_await weak_guard(weak): yields the object if it is alive, destroys the
+// frame otherwise. Never suspends a live coroutine.
+template <typename T> class WeakGuard {
+public:
+  explicit WeakGuard(WeakPtr<T> weak) noexcept : weak_(std::move(weak)) {}
+
+  bool await_ready() noexcept {
+    ptr_ = weak_.get();
+    return ptr_ != nullptr;
+  }
+  void await_suspend(std::coroutine_handle<> handle) noexcept {
+    handle.destroy();
+  }
+  T *await_resume() const noexcept { return ptr_; }
+
+private:
+  WeakPtr<T> weak_;
+  T *ptr_ = nullptr;
+};
+
+// co_await weak_guard(weak, suspend): suspends and calls |suspend| with the
+// WeakResumer the event source should run on completion. The object is
+// checked again on resumption; the result is the live object.
+//
+// A kOnInvalidate waiter registers itself on the owner's flag in its own
+// frame, so neither mode allocates.
+template <typename T, typename Suspend> class WeakGuardedSuspend final
+    : private internal::FlagObserver {
+public:
+  WeakGuardedSuspend(WeakPtr<T> weak, Suspend suspend, WeakGuardCancel cancel)
+      : weak_(std::move(weak)), suspend_(std::move(suspend)), cancel_(cancel) {}
+  ~WeakGuardedSuspend() { Unregister(); }
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle) {
+    const internal::FlagRef &flag = internal::WeakPtrAccess::GetFlag(weak_);
+    // An owner that is already gone never sees |suspend|.
+    if (!weak_.get()) {
+      handle.destroy();
+      return;
+    }
+    if (cancel_ == WeakGuardCancel::kOnInvalidate) {
+      // Observers run on the owner's sequence.
+      assert(!flag->IsConcurrent());
+      handle_ = handle;
+      flag->AddObserver(this);
+    }
+    // |suspend| may run the resumer right away, which may finish the
+    // coroutine and destroy this awaiter; nothing here is touched after it.
+    Suspend suspend = std::move(suspend_);
+    suspend(WeakResumer(handle, flag, cancel_));
+  }
+  T *await_resume() noexcept {
+    Unregister();
+    return weak_.get();
+  }
+
+private:
+  WeakGuardedSuspend(const WeakGuardedSuspend &) = delete;
+  WeakGuardedSuspend &operator=(const WeakGuardedSuspend &) = delete;
+
+  // The flag already unlinked this waiter. Destroying the frame destroys
+  // this awaiter too, and with it our reference to the flag; the owner still
+  // holds one for the rest of the invalidation.
+  void OnFlagInvalidated() override { handle_.destroy(); }
+
+  void Unregister() {
+    if (handle_)
+      internal::WeakPtrAccess::GetFlag(weak_)->RemoveObserver(this);
+    handle_ = nullptr;
+  }
+
+  WeakPtr<T> weak_;
+  Suspend suspend_;
+  const WeakGuardCancel cancel_;
+  // Set while registered on the flag.
+  std::coroutine_handle<> handle_;
+};
+
+// Guards a coroutine against resuming into an invalidated owner:
+//
+//   Task Connection::ReadLoop() {
+//     auto weak = weak_factory_.GetWeakPtr();
+//     for (;;) {
+//       Connection *self = co_await weak_guard(weak, [&](WeakResumer wake) {
+//         socket_.OnReadable(std::move(wake));
+//       });
+//       self->Consume(socket_.ReadAll());
+//     }
+//   }
+//
+// The frame is destroyed instead of resumed once the owner is gone, so it
+// must not be awaited by another coroutine: nothing would ever resume that
+// one. Use it in detached handler coroutines, and keep destructors of frame
+// locals off the owner, which may be gone by the time they run.
+template <typename T> WeakGuard<T> weak_guard(WeakPtr<T> weak) noexcept {
+  return WeakGuard<T>(std::move(weak));
+}
+
+template <typename T, typename Suspend>
+WeakGuardedSuspend<T, std::decay_t<Suspend>>
+weak_guard(WeakPtr<T> weak, Suspend &&suspend,
+           WeakGuardCancel cancel = WeakGuardCancel::kOnResume) {
+  static_assert(std::is_invocable<std::decay_t<Suspend> &, WeakResumer>::value,
+                "|suspend| must take a WeakResumer.");
+  return WeakGuardedSuspend<T, std::decay_t<Suspend>>(
+      std::move(weak), std::forward<Suspend>(suspend), cancel);
+}
+
+} // namespace xcpp
+
+#endif // XLIB_HAS_WEAK_GUARD
+
+#endif // !XLIB_BASE_WEAK_GUARD_INCLUDE_H_
@@ -0,0 +1,303 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_WEAK_KEY_MAP_INCLUDE_H_
+#define XLIB_BASE_WEAK_KEY_MAP_INCLUDE_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "base/weak_ptr.h"
+
+namespace xcpp {
+
+// An open-addressing hash map keyed by weak pointers. Keys hash and compare by
+// the address cached in the WeakPtr, so neither insertion nor lookup
+// dereferences anything; lookups take a raw K* directly. An entry whose key
+// was invalidated is dead: it never matches, and is reclaimed by whichever
+// probe runs into it, by a few slots of incremental sweeping on every insert,
+// and by a full Purge() before the table grows. A cache keyed by short-lived
+// objects therefore stays bounded by its live keys.
+//
+// Linear probing with backward-shift deletion, so there are no tombstones.
+// Pointers to values are invalidated by any insertion, erase or purge.
+//
+// Not thread-safe; use it on one sequence.
+template <typename K, typename V> class WeakKeyMap {
+public:
+  WeakKeyMap() = default;
+  ~WeakKeyMap() { clear(); }
+
+  WeakKeyMap(WeakKeyMap &&other) noexcept
+      : slots_(std::move(other.slots_)), size_(other.size_),
+        shift_(other.shift_), sweep_(other.sweep_) {
+    other.size_ = 0;
+  }
+  WeakKeyMap &operator=(WeakKeyMap &&other) noexcept {
+    if (this != &other) {
+      clear();
+      slots_ = std::move(other.slots_);
+      size_ = other.size_;
+      shift_ = other.shift_;
+      sweep_ = other.sweep_;
+      other.size_ = 0;
+    }
+    return *this;
+  }
+
+  // Null if |key| has no entry or the entry is dead. The const overloads
+  // only skip dead entries, they don't reclaim them.
+  V *Find(const K *key) {
+    const std::size_t index = FindIndex(Address(key));
+    return index == kNotFound ? nullptr : &slots_[index].value();
+  }
+  const V *Find(const K *key) const {
+    const std::size_t index = FindIndex(Address(key));
+    return index == kNotFound ? nullptr : &slots_[index].value();
+  }
+  V *Find(const WeakPtr<K> &key) { return Find(Raw(key)); }
+
+  bool Contains(const K *key) const { return Find(key) != nullptr; }
+
+  // Inserts (|key|, V(args...)) unless a live entry for |key| exists. Keys
+  // that are already invalid are not inserted and yield null.
+  template <typename... Args>
+  std::pair<V *, bool> Emplace(const WeakPtr<K> &key, Args &&... args) {
+    const internal::FlagRef &flag = internal::WeakPtrAccess::GetFlag(key);
+    if (!flag.IsValid())
+      return {nullptr, false};
+    const std::uintptr_t address = internal::WeakPtrAccess::GetRaw(key);
+    if (V *value = FindValue(address))
+      return {value, false};
+    Sweep(kSweepPerInsert);
+    if ((size_ + 1) * kMaxLoadDenominator > capacity() * kMaxLoadNumerator)
+      Grow();
+    Slot &slot = slots_[InsertIndex(address)];
+    slot.Construct(flag, address, std::forward<Args>(args)...);
+    ++size_;
+    return {&slot.value(), true};
+  }
+  std::pair<V *, bool> Insert(const WeakPtr<K> &key, V value) {
+    return Emplace(key, std::move(value));
+  }
+
+  // Default-constructs the value if needed; |key| has to be valid.
+  V &operator[](const WeakPtr<K> &key) {
+    V *value = Emplace(key).first;
+    assert(value);
+    return *value;
+  }
+
+  bool Erase(const K *key) {
+    const std::size_t index = FindIndex(Address(key));
+    if (index == kNotFound)
+      return false;
+    EraseAt(index);
+    return true;
+  }
+
+  // Calls |function|(K*, V&) for every live entry, reclaiming dead ones.
+  // |function| must not modify the map.
+  template <typename Function> void ForEach(Function &&function) {
+    Purge();
+    for (auto &slot : slots_) {
+      if (slot.full())
+        function(reinterpret_cast<K *>(slot.key), slot.value());
+    }
+  }
+
+  // Reclaims every dead entry now.
+  void Purge() {
+    for (std::size_t i = 0; i < slots_.size();) {
+      if (slots_[i].full() && !slots_[i].flag.IsValid())
+        EraseAt(i); // Re-examine |i|: a later entry may have moved there.
+      else
+        ++i;
+    }
+  }
+
+  void clear() {
+    for (auto &slot : slots_) {
+      if (slot.full())
+        slot.Destroy();
+    }
+    size_ = 0;
+  }
+
+  // Entries, dead ones included until they are reclaimed.
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::size_t capacity() const { return slots_.size(); }
+
+private:
+  WeakKeyMap(const WeakKeyMap &) = delete;
+  WeakKeyMap &operator=(const WeakKeyMap &) = delete;
+
+  static constexpr std::size_t kNotFound = static_cast<std::size_t>(-1);
+  static constexpr std::size_t kMinCapacity = 8;
+  static constexpr std::size_t kMaxLoadNumerator = 3;
+  static constexpr std::size_t kMaxLoadDenominator = 4;
+  static constexpr std::size_t kSweepPerInsert = 2;
+
+  // Empty while |flag| is null.
+  struct Slot {
+    Slot() = default;
+    Slot(Slot &&other) noexcept : key(other.key) {
+      if (other.full()) {
+        flag = std::move(other.flag);
+        ::new (static_cast<void *>(&storage)) V(std::move(other.value()));
+        other.value().~V();
+      }
+    }
+    ~Slot() {
+      if (full())
+        Destroy();
+    }
+
+    bool full() const { return static_cast<bool>(flag); }
+    V &value() { return *reinterpret_cast<V *>(&storage); }
+    const V &value() const { return *reinterpret_cast<const V *>(&storage); }
+
+    template <typename... Args>
+    void Construct(const internal::FlagRef &new_flag, std::uintptr_t new_key,
+                   Args &&... args) {
+      ::new (static_cast<void *>(&storage)) V(std::forward<Args>(args)...);
+      flag = new_flag;
+      key = new_key;
+    }
+    void MoveFrom(Slot &other) {
+      ::new (static_cast<void *>(&storage)) V(std::move(other.value()));
+      flag = std::move(other.flag);
+      key = other.key;
+      other.value().~V();
+    }
+    void Destroy() {
+      value().~V();
+      flag.reset();
+    }
+
+    internal::FlagRef flag;
+    std::uintptr_t key = 0;
+    typename std::aligned_storage<sizeof(V), alignof(V)>::type storage;
+  };
+
+  static std::uintptr_t Address(const K *key) {
+    return reinterpret_cast<std::uintptr_t>(key);
+  }
+  static const K *Raw(const WeakPtr<K> &key) {
+    return reinterpret_cast<const K *>(internal::WeakPtrAccess::GetRaw(key));
+  }
+
+  // Fibonacci hashing: the top bits of the product pick the slot.
+  std::size_t Home(std::uintptr_t address) const {
+    return static_cast<std::size_t>(
+        (static_cast<std::uint64_t>(address) * 0x9E3779B97F4A7C15ull) >>
+        shift_);
+  }
+  std::size_t Mask() const { return slots_.size() - 1; }
+
+  V *FindValue(std::uintptr_t address) {
+    const std::size_t index = FindIndex(address);
+    return index == kNotFound ? nullptr : &slots_[index].value();
+  }
+
+  // Dead entries met on the way are erased; erasing shifts the rest of the
+  // cluster back, so the same index is looked at again.
+  std::size_t FindIndex(std::uintptr_t address) {
+    if (!size_ || !address)
+      return kNotFound;
+    std::size_t index = Home(address);
+    while (slots_[index].full()) {
+      Slot &slot = slots_[index];
+      if (!slot.flag.IsValid()) {
+        EraseAt(index);
+        continue;
+      }
+      if (slot.key == address)
+        return index;
+      index = (index + 1) & Mask();
+    }
+    return kNotFound;
+  }
+  // Read-only probe: dead entries stay where they are and are stepped over.
+  std::size_t FindIndex(std::uintptr_t address) const {
+    if (!size_ || !address)
+      return kNotFound;
+    for (std::size_t index = Home(address); slots_[index].full();
+         index = (index + 1) & Mask()) {
+      const Slot &slot = slots_[index];
+      if (slot.key == address && slot.flag.IsValid())
+        return index;
+    }
+    return kNotFound;
+  }
+
+  std::size_t InsertIndex(std::uintptr_t address) const {
+    std::size_t index = Home(address);
+    while (slots_[index].full())
+      index = (index + 1) & Mask();
+    return index;
+  }
+
+  void EraseAt(std::size_t index) {
+    slots_[index].Destroy();
+    --size_;
+    // Backward shift: pull later cluster members whose home is at or before
+    // the hole into it, so probes never need tombstones.
+    std::size_t hole = index;
+    for (std::size_t next = (hole + 1) & Mask(); slots_[next].full();
+         next = (next + 1) & Mask()) {
+      const std::size_t home = Home(slots_[next].key);
+      if (((next - home) & Mask()) >= ((next - hole) & Mask())) {
+        slots_[hole].MoveFrom(slots_[next]);
+        hole = next;
+      }
+    }
+  }
+
+  void Sweep(std::size_t count) {
+    for (std::size_t i = 0; i < count && !slots_.empty(); ++i) {
+      sweep_ &= Mask();
+      if (slots_[sweep_].full() && !slots_[sweep_].flag.IsValid())
+        EraseAt(sweep_);
+      else
+        ++sweep_;
+    }
+  }
+
+  void Grow() {
+    Purge();
+    if (slots_.size() &&
+        (size_ + 1) * kMaxLoadDenominator <= capacity() * kMaxLoadNumerator)
+      return;
+    std::vector<Slot> old(slots_.empty() ? kMinCapacity : slots_.size() * 2);
+    old.swap(slots_);
+    shift_ = 64;
+    for (std::size_t size = slots_.size(); size > 1; size >>= 1)
+      --shift_;
+    sweep_ = 0;
+    for (auto &slot : old) {
+      if (slot.full())
+        slots_[InsertIndex(slot.key)].MoveFrom(slot);
+    }
+  }
+
+  std::vector<Slot> slots_;
+  std::size_t size_ = 0;
+  unsigned shift_ = 64;
+  std::size_t sweep_ = 0;
+};
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_WEAK_KEY_MAP_INCLUDE_H_
@@ -9,58 +9,72 @@
 #ifndef XLIB_BASE_WEAK_PTR_INCLUDE_H_
 #define XLIB_BASE_WEAK_PTR_INCLUDE_H_
 
-#include <assert>
+#include <atomic>
+#include <cassert>
+#include <chrono>
 #include <cstddef>
+#include <functional>
 #include <memory>
 #include <mutex>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
 
+#include "base/hazard_pointer.h"
+#include "base/sequence_token.h"
 #include "base/uintptr_cast.h"
+#include "base/weak_ptr_memory.h"
+#include "base/weak_ptr_stats.h"
+#ifdef XLIB_WEAK_PTR_TRACING
+#include "base/weak_ptr_trace.h"
+#endif // XLIB_WEAK_PTR_TRACING
 
 namespace xcpp {
 
 namespace internal {
 
-template <typename T = unsigned char> class Flag {
-  using flag_type = std::shared_ptr<T>;
-  using weak_type = std::weak_ptr<T>;
-  using data_type = T;
-  static flag_type GetRef() { return std::make_shared<data_type>(); }
-  static flag_type GetRef(const weak_type &flag) { return flag.lock(); }
-  static bool HasRefs(const weak_type &flag) {
-    auto ref = flag.lock();
-    if (!ref)
-      return false;
-    return 1 != ref.use_count();
-  }
-};
-
+// Threading policies are static: FlagImpl inherits the selected checker and
+// calls it without virtual dispatch. kChecksSequence tells the type-erased
+// Flag whether the policy has anything to check at all, kConcurrent whether
+// invalidation has to wait for WeakPins held on other threads, and
+// kHazardPins whether those pins are published in hazard slots rather than
+// counted on the flag.
 template <typename T = std::mutex> class ThreadingChecker;
 
 template <> class ThreadingChecker<void> {
 public:
+  static constexpr bool kChecksSequence = false;
+  static constexpr bool kConcurrent = false;
+  static constexpr bool kHazardPins = false;
+
   ThreadingChecker() = default;
   ThreadingChecker(ThreadingChecker &&) = default;
   ThreadingChecker &operator=(ThreadingChecker &&) = default;
 
 public:
-  virtual bool CalledOnValidSequence() const { return true; }
-  virtual void DetachFromSequence() const {}
+  bool CalledOnValidSequence() const { return true; }
+  void DetachFromSequence() const {}
 
 protected:
-  virtual ~ThreadingChecker() = default;
+  ~ThreadingChecker() = default;
 
 private:
   ThreadingChecker(const ThreadingChecker &) = delete;
   ThreadingChecker &operator=(const ThreadingChecker &) = delete;
 };
 
-template <> class ThreadingChecker<std::mutex> : public ThreadingChecker<void> {
+template <> class ThreadingChecker<std::mutex> {
 public:
+  static constexpr bool kChecksSequence = true;
+  static constexpr bool kConcurrent = false;
+  static constexpr bool kHazardPins = false;
+
   ThreadingChecker() = default;
   ThreadingChecker(ThreadingChecker &&other) {
     const bool other_called_on_valid_threading = other.CalledOnValidSequence();
-    static(other_called_on_valid_threading);
+    assert(other_called_on_valid_threading);
+    (void)other_called_on_valid_threading;
     valid_thread_id_ = std::move(other.valid_thread_id_);
   }
   ThreadingChecker &operator=(ThreadingChecker &&other) {
@@ -71,8 +85,8 @@ public:
   }
 
 public:
-  virtual bool CalledOnValidSequence() const override {
-    std::lock_guard<std::mutex> lock(mutex_);
+  bool CalledOnValidSequence() const noexcept {
+    Lock lock(mutex_);
     if (valid_thread_id_ == std::thread::id()) {
       auto obj = const_cast<ThreadingChecker *>(this);
       obj->valid_thread_id_ = std::this_thread::get_id();
@@ -80,69 +94,722 @@ public:
     }
     return valid_thread_id_ == std::this_thread::get_id();
   }
-  virtual void DetachFromSequence() const override {
-    std::lock_guard<std::mutex> lock(mutex_);
+  void DetachFromSequence() const noexcept {
+    Lock lock(mutex_);
     auto obj = const_cast<ThreadingChecker *>(this);
     obj->valid_thread_id_ = std::thread::id();
   }
 
 protected:
-  virtual ~ThreadingChecker() = default;
+  ~ThreadingChecker() = default;
+
+private:
+  ThreadingChecker(const ThreadingChecker &) = delete;
+  ThreadingChecker &operator=(const ThreadingChecker &) = delete;
+
+  // std::mutex::lock() may throw std::system_error, try_lock() and unlock()
+  // don't. The check runs inside the noexcept WeakPtr::get() in DEBUG
+  // builds, and the critical section is a few loads, so spinning is cheap.
+  class Lock {
+  public:
+    explicit Lock(std::mutex &mutex) noexcept : mutex_(mutex) {
+      while (!mutex_.try_lock())
+        std::this_thread::yield();
+    }
+    ~Lock() { mutex_.unlock(); }
+
+  private:
+    Lock(const Lock &) = delete;
+    Lock &operator=(const Lock &) = delete;
+
+    std::mutex &mutex_;
+  };
+
+  mutable std::thread::id valid_thread_id_{std::this_thread::get_id()};
+  mutable std::mutex mutex_;
+};
+
+// Lock-free variant: the first check binds the calling thread with a single
+// compare-exchange, later checks are one atomic load.
+template <> class ThreadingChecker<std::atomic<std::thread::id>> {
+public:
+  static constexpr bool kChecksSequence = true;
+  static constexpr bool kConcurrent = false;
+  static constexpr bool kHazardPins = false;
+
+  ThreadingChecker() = default;
+  ThreadingChecker(ThreadingChecker &&other) {
+    const bool other_called_on_valid_threading = other.CalledOnValidSequence();
+    assert(other_called_on_valid_threading);
+    (void)other_called_on_valid_threading;
+    valid_thread_id_.store(
+        other.valid_thread_id_.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+  }
+  ThreadingChecker &operator=(ThreadingChecker &&other) {
+    assert(CalledOnValidSequence());
+    assert(other.CalledOnValidSequence());
+    valid_thread_id_.store(
+        other.valid_thread_id_.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+    return *this;
+  }
+
+public:
+  bool CalledOnValidSequence() const {
+    const std::thread::id current = std::this_thread::get_id();
+    std::thread::id bound = valid_thread_id_.load(std::memory_order_acquire);
+    if (bound == current)
+      return true;
+    if (bound != std::thread::id())
+      return false;
+    // Unbound: claim it; losing the race to this same thread is fine too.
+    return valid_thread_id_.compare_exchange_strong(
+               bound, current, std::memory_order_acq_rel,
+               std::memory_order_acquire) ||
+           bound == current;
+  }
+  void DetachFromSequence() const {
+    valid_thread_id_.store(std::thread::id(), std::memory_order_release);
+  }
+
+protected:
+  ~ThreadingChecker() = default;
+
+private:
+  ThreadingChecker(const ThreadingChecker &) = delete;
+  ThreadingChecker &operator=(const ThreadingChecker &) = delete;
+
+  mutable std::atomic<std::thread::id> valid_thread_id_{std::thread::id()};
+};
+
+// Validates against the current SequenceToken instead of the OS thread, so
+// an object can follow its sequence across the workers of a pool. Checks are
+// one integer compare; BindToSequence() rebinds with a single atomic store.
+template <> class ThreadingChecker<SequenceToken> {
+public:
+  static constexpr bool kChecksSequence = true;
+  static constexpr bool kConcurrent = false;
+  static constexpr bool kHazardPins = false;
+
+  ThreadingChecker() = default;
+  ThreadingChecker(ThreadingChecker &&other) {
+    assert(other.CalledOnValidSequence());
+    valid_sequence_.store(other.valid_sequence_.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+  }
+  ThreadingChecker &operator=(ThreadingChecker &&other) {
+    assert(CalledOnValidSequence());
+    assert(other.CalledOnValidSequence());
+    valid_sequence_.store(other.valid_sequence_.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+    return *this;
+  }
+
+public:
+  bool CalledOnValidSequence() const {
+    const std::uint64_t current =
+        SequenceToken::GetForCurrentThread().ToInternalValue();
+    std::uint64_t bound = valid_sequence_.load(std::memory_order_acquire);
+    if (bound == current)
+      return true;
+    if (bound != 0)
+      return false;
+    return valid_sequence_.compare_exchange_strong(
+               bound, current, std::memory_order_acq_rel,
+               std::memory_order_acquire) ||
+           bound == current;
+  }
+  void DetachFromSequence() const {
+    valid_sequence_.store(0, std::memory_order_release);
+  }
+  void BindToSequence(const SequenceToken &token) const {
+    valid_sequence_.store(token.ToInternalValue(), std::memory_order_release);
+  }
+
+protected:
+  ~ThreadingChecker() = default;
+
+private:
+  ThreadingChecker(const ThreadingChecker &) = delete;
+  ThreadingChecker &operator=(const ThreadingChecker &) = delete;
+
+  mutable std::atomic<std::uint64_t> valid_sequence_{0};
+};
+
+// Tag for ThreadingChecker<Concurrent>.
+struct Concurrent {};
+
+// Opt-in mode for owners whose weak pointers are read from other threads.
+// There is no sequence to check; instead readers pin the object with a
+// WeakPin and InvalidateWeakPtrs() waits until every pin taken before the
+// invalidation has been released. Owners call InvalidateWeakPtrs() first
+// thing in their destructor so no member is torn down under a reader.
+template <> class ThreadingChecker<Concurrent> {
+public:
+  static constexpr bool kChecksSequence = false;
+  static constexpr bool kConcurrent = true;
+  static constexpr bool kHazardPins = false;
+
+  ThreadingChecker() = default;
+
+public:
+  bool CalledOnValidSequence() const { return true; }
+  void DetachFromSequence() const {}
+
+protected:
+  ~ThreadingChecker() = default;
+
+private:
+  ThreadingChecker(const ThreadingChecker &) = delete;
+  ThreadingChecker &operator=(const ThreadingChecker &) = delete;
+};
+
+using ConcurrentThreadingChecker = ThreadingChecker<Concurrent>;
+
+// Tag for ThreadingChecker<HazardPointers>.
+struct HazardPointers {};
+
+// Same contract as ThreadingChecker<Concurrent>, but a WeakPin publishes the
+// flag in one of the reading thread's hazard slots (base/hazard_pointer.h)
+// instead of bumping a count on the flag. Readers of a popular object then
+// only write their own cache line; InvalidateWeakPtrs() pays instead, with a
+// scan over every thread's slots. Pins nested deeper than the per-thread slot
+// count fall back to the counted pin.
+template <> class ThreadingChecker<HazardPointers> {
+public:
+  static constexpr bool kChecksSequence = false;
+  static constexpr bool kConcurrent = true;
+  static constexpr bool kHazardPins = true;
+
+  ThreadingChecker() = default;
+
+public:
+  bool CalledOnValidSequence() const { return true; }
+  void DetachFromSequence() const {}
+
+protected:
+  ~ThreadingChecker() = default;
 
 private:
   ThreadingChecker(const ThreadingChecker &) = delete;
   ThreadingChecker &operator=(const ThreadingChecker &) = delete;
+};
+
+using HazardThreadingChecker = ThreadingChecker<HazardPointers>;
+
+#ifdef DEBUG
+using DefaultThreadingChecker = ThreadingChecker<std::atomic<std::thread::id>>;
+#else
+using DefaultThreadingChecker = ThreadingChecker<void>;
+#endif // DEBUG
+
+class Flag;
+
+// Told when a Flag is invalidated, so a container keyed by flags (e.g.
+// CancelableTaskQueue) can drop everything tied to it at once instead of
+// finding out entry by entry. Intrusive, so registering never allocates.
+// Observers are added, removed and notified on the owner's sequence.
+class FlagObserver {
+public:
+  virtual void OnFlagInvalidated() = 0;
+
+protected:
+  FlagObserver() = default;
+  ~FlagObserver() = default;
+
+private:
+  friend class Flag;
+
+  FlagObserver *prev_ = nullptr;
+  FlagObserver *next_ = nullptr;
+};
+
+// The invalidation flag shared by an owner and all WeakPtrs it handed out.
+// Validity, the reference count and the threading checker live in a single
+// intrusive allocation (see FlagImpl), so a WeakPtr only carries one pointer
+// to it.
+//
+// A flag with a parent (see WeakGroup) observes the parent while it has
+// observers of its own, and passes the parent's invalidation on to them.
+class Flag : private FlagObserver {
+public:
+  void AddRef() const noexcept {
+    ref_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void Release() const noexcept {
+    if (ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      Destroy();
+  }
+  bool HasOneRef() const noexcept { return RefCount() == 1; }
+  // The owner holds one reference, every WeakPtr (or container entry) that
+  // still points at this flag holds one more.
+  std::size_t RefCount() const noexcept {
+    return ref_count_.load(std::memory_order_acquire);
+  }
+
+  // Hazard pins re-validate with seq_cst after publishing their slot, which
+  // pairs with the seq_cst Invalidate() ahead of the slot scan.
+  // A flag in a WeakGroup is also invalid once the group's flag is. Groups
+  // don't nest, so that is one more load, and get() stays free of calls.
+  bool IsValid(std::memory_order order = std::memory_order_acquire) const
+      noexcept {
+    return !(state_.load(order) & kInvalidated) &&
+           (!parent_ || !(parent_->state_.load(order) & kInvalidated));
+  }
+  bool HasParent() const noexcept { return parent_ != nullptr; }
+  // Set once, before the flag is handed out; the flag keeps |parent| alive.
+  void SetParent(const Flag *parent) {
+    assert(!parent_ && !parent->parent_);
+    parent->AddRef();
+    parent_ = parent;
+    if (observers_)
+      parent_->AddObserver(AsObserver());
+  }
+  void Invalidate() {
+    state_.fetch_or(kInvalidated, std::memory_order_seq_cst);
+    NotifyObservers();
+  }
+
+  void AddObserver(FlagObserver *observer) const {
+    assert(!observer->prev_ && !observer->next_ && observers_ != observer);
+    if (parent_ && !observers_)
+      parent_->AddObserver(AsObserver());
+    observer->next_ = observers_;
+    if (observers_)
+      observers_->prev_ = observer;
+    observers_ = observer;
+  }
+  // A no-op for observers that aren't registered (any more).
+  void RemoveObserver(FlagObserver *observer) const {
+    if (!observer->prev_ && observers_ != observer)
+      return;
+    if (observer->prev_)
+      observer->prev_->next_ = observer->next_;
+    else
+      observers_ = observer->next_;
+    if (observer->next_)
+      observer->next_->prev_ = observer->prev_;
+    observer->prev_ = observer->next_ = nullptr;
+    if (parent_ && !observers_)
+      parent_->RemoveObserver(AsObserver());
+  }
+
+  // A pin keeps the object alive across threads for owners using the
+  // concurrent policy: their invalidation waits for the pin count to drain.
+  bool TryPin() const noexcept {
+    if (state_.fetch_add(kPinUnit, std::memory_order_acquire) & kInvalidated) {
+      Unpin();
+      return false;
+    }
+    return true;
+  }
+  void Unpin() const noexcept {
+    state_.fetch_sub(kPinUnit, std::memory_order_release);
+  }
+  void WaitForPins() const {
+    while (state_.load(std::memory_order_acquire) >= kPinUnit)
+      std::this_thread::yield();
+  }
+  // Only pins on concurrent flags need TryPin() or a hazard slot; other
+  // owners never invalidate off their sequence.
+  bool IsConcurrent() const noexcept { return concurrent_; }
+  bool UsesHazardPins() const noexcept { return hazard_pins_; }
+
+  // Used by WeakPtr, which doesn't know the owner's policy. Policies with
+  // nothing to check never reach the virtual call.
+  bool CalledOnValidSequence() const {
+    return !checks_sequence_ || CheckSequence();
+  }
+
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+  void SetCounters(WeakPtrCounters *counters) {
+    counters_ = counters;
+    created_ = std::chrono::steady_clock::now();
+    if (counters_)
+      WeakPtrCounters::Increment(counters_->flags_created);
+  }
+  void CountGet(bool valid) const {
+    if (counters_)
+      WeakPtrCounters::Increment(valid ? counters_->gets
+                                       : counters_->failed_gets);
+  }
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+
+protected:
+  Flag(bool checks_sequence, bool concurrent, bool hazard_pins)
+      : checks_sequence_(checks_sequence), concurrent_(concurrent),
+        hazard_pins_(hazard_pins) {}
+  virtual ~Flag() {
+    assert(!observers_);
+    if (parent_)
+      parent_->Release();
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+    if (counters_) {
+      WeakPtrCounters::Increment(counters_->flags_destroyed);
+      WeakPtrCounters::Increment(
+          counters_->flag_lifetime_ns,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - created_)
+              .count());
+    }
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+  }
+
+  virtual bool CheckSequence() const { return true; }
+  // Returns the storage to the allocator the flag was created with.
+  virtual void Destroy() const noexcept = 0;
+
+private:
+  Flag(const Flag &) = delete;
+  Flag &operator=(const Flag &) = delete;
+
+  // The parent was invalidated, which makes this flag invalid as well.
+  void OnFlagInvalidated() override { NotifyObservers(); }
+
+  // Each observer is unlinked before it runs, so it may delete itself or
+  // remove others.
+  void NotifyObservers() const {
+    while (FlagObserver *observer = observers_) {
+      RemoveObserver(observer);
+      observer->OnFlagInvalidated();
+    }
+  }
+
+  // Observing the parent doesn't change the observable state of a flag.
+  FlagObserver *AsObserver() const {
+    return const_cast<Flag *>(this);
+  }
+
+  // Bit 0 is set once invalidated, the remaining bits count pins.
+  static constexpr std::uint32_t kInvalidated = 1;
+  static constexpr std::uint32_t kPinUnit = 2;
+
+  // The two words every WeakPtr copy and get() touches come first, so they
+  // share the flag's first cache line whatever the layout.
+  mutable std::atomic<std::size_t> ref_count_{0};
+  mutable std::atomic<std::uint32_t> state_{0};
+  const bool checks_sequence_;
+  const bool concurrent_;
+  const bool hazard_pins_;
+  mutable FlagObserver *observers_ = nullptr;
+  const Flag *parent_ = nullptr;
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+  WeakPtrCounters *counters_ = nullptr;
+  std::chrono::steady_clock::time_point created_;
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+};
+
+constexpr std::size_t kFlagCacheLineSize = 64;
+
+// Allocators opt into the cache-line layout below by declaring
+// kCacheLineFlagLayout = true, e.g. CacheAlignedFlagAllocator.
+template <typename Allocator, typename = void>
+struct UsesCacheLineFlagLayout : std::false_type {};
+template <typename Allocator>
+struct UsesCacheLineFlagLayout<Allocator,
+                               decltype(void(Allocator::kCacheLineFlagLayout))>
+    : std::integral_constant<bool, Allocator::kCacheLineFlagLayout> {};
+
+// Where the threading policy's state lives: right behind the Flag, or, in
+// the cache-line layout, on a line of its own. The flag is then over-aligned
+// and padded to whole lines, so neither a neighbouring flag nor the checker's
+// thread id or mutex ever shares the line of the reference count.
+template <typename Threading, bool kCacheLineLayout>
+class FlagColdFields : public Threading {};
+template <typename Threading>
+class alignas(kFlagCacheLineSize) FlagColdFields<Threading, true>
+    : public Threading {};
+
+// The policy is an empty base for ThreadingChecker<void>, so release flags
+// are no larger than Flag itself. Allocator must be stateless; it is rebound
+// to FlagImpl and default-constructed to create and destroy the flag.
+template <typename Threading, typename Allocator>
+class FlagImpl final
+    : public Flag,
+      private FlagColdFields<Threading,
+                             UsesCacheLineFlagLayout<Allocator>::value> {
+public:
+  static FlagImpl *Create() {
+    FlagAllocator allocator;
+    FlagImpl *flag = AllocatorTraits::allocate(allocator, 1);
+    ::new (static_cast<void *>(flag)) FlagImpl();
+#ifdef XLIB_WEAK_PTR_MEMORY_ACCOUNTING
+    FlagHeapAccounting::Get().OnAllocated(flag, sizeof(FlagImpl),
+                                          CheckerSize());
+#endif // XLIB_WEAK_PTR_MEMORY_ACCOUNTING
+    return flag;
+  }
+
+  bool CalledOnValidSequence() const {
+    return Threading::CalledOnValidSequence();
+  }
+  void DetachFromSequence() const { Threading::DetachFromSequence(); }
+  // Only for policies that have a notion of binding, e.g. SequenceToken.
+  template <typename Token> void BindToSequence(const Token &token) const {
+    Threading::BindToSequence(token);
+  }
+
+private:
+  using FlagAllocator = typename std::allocator_traits<
+      Allocator>::template rebind_alloc<FlagImpl>;
+  using AllocatorTraits = std::allocator_traits<FlagAllocator>;
+  static_assert(std::is_empty<Allocator>::value,
+                "Flag allocators must be stateless.");
+
+  // What the threading policy, and the padding of the cache-line layout, add
+  // on top of the bare Flag.
+  static constexpr std::size_t CheckerSize() {
+    return sizeof(FlagImpl) - sizeof(Flag);
+  }
+
+  FlagImpl()
+      : Flag(Threading::kChecksSequence, Threading::kConcurrent,
+             Threading::kHazardPins) {}
+  ~FlagImpl() override = default;
+
+  bool CheckSequence() const override {
+    return Threading::CalledOnValidSequence();
+  }
+  void Destroy() const noexcept override {
+    FlagAllocator allocator;
+    FlagImpl *flag = const_cast<FlagImpl *>(this);
+    flag->~FlagImpl();
+#ifdef XLIB_WEAK_PTR_MEMORY_ACCOUNTING
+    FlagHeapAccounting::Get().OnFreed(flag, sizeof(FlagImpl), CheckerSize());
+#endif // XLIB_WEAK_PTR_MEMORY_ACCOUNTING
+    AllocatorTraits::deallocate(allocator, flag, 1);
+  }
+};
+
+static_assert(sizeof(FlagImpl<ThreadingChecker<void>, std::allocator<void>>) ==
+                  sizeof(Flag),
+              "The no-op threading policy must not add storage.");
+#ifndef XLIB_WEAK_PTR_INSTRUMENTATION
+static_assert(sizeof(Flag) <= kFlagCacheLineSize,
+              "The hot part of a flag must fit one cache line.");
+#endif // !XLIB_WEAK_PTR_INSTRUMENTATION
+
+// Intrusive reference to a Flag.
+class FlagRef {
+public:
+  constexpr FlagRef() noexcept = default;
+  explicit FlagRef(Flag *flag) noexcept : flag_(flag) {
+    if (flag_)
+      flag_->AddRef();
+  }
+  FlagRef(const FlagRef &other) noexcept : FlagRef(other.flag_) {}
+  FlagRef(FlagRef &&other) noexcept : flag_(other.flag_) {
+    other.flag_ = nullptr;
+  }
+  ~FlagRef() { reset(); }
+
+  FlagRef &operator=(const FlagRef &other) noexcept {
+    FlagRef(other).swap(*this);
+    return *this;
+  }
+  FlagRef &operator=(FlagRef &&other) noexcept {
+    FlagRef(std::move(other)).swap(*this);
+    return *this;
+  }
+
+  void reset() noexcept {
+    if (flag_)
+      flag_->Release();
+    flag_ = nullptr;
+  }
+  void swap(FlagRef &other) noexcept { std::swap(flag_, other.flag_); }
+
+  Flag *get() const noexcept { return flag_; }
+  Flag *operator->() const noexcept { return flag_; }
+  explicit operator bool() const noexcept { return flag_ != nullptr; }
+
+  bool IsValid() const noexcept { return flag_ && flag_->IsValid(); }
+
+private:
+  Flag *flag_ = nullptr;
+};
+
+// Owns the Flag of a WeakPtrFactory/SupportsWeakPtr. The flag is allocated on
+// the first GetRef(), so owners that never hand out a WeakPtr don't allocate.
+template <typename Threading, typename Allocator> class FlagOwner {
+public:
+  FlagOwner() = default;
+  ~FlagOwner() { Invalidate(); }
+
+  const FlagRef &GetRef() {
+    if (!ref_) {
+      ref_ = FlagRef(Impl::Create());
+      if (parent_)
+        ref_->SetParent(parent_.get());
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+      ref_->SetCounters(counters_);
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+    }
+    return ref_;
+  }
+
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+  void SetCounters(WeakPtrCounters *counters) { counters_ = counters; }
+  void CountWeakPtrCreated() const {
+    if (counters_)
+      WeakPtrCounters::Increment(counters_->weak_ptrs_created);
+  }
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+
+  // Null until the first GetRef() and after each Invalidate().
+  const Flag *current() const { return ref_.get(); }
+
+  bool HasRefs() const { return WeakRefCount() != 0; }
+  std::size_t WeakRefCount() const { return ref_ ? ref_->RefCount() - 1 : 0; }
+
+  // Makes |parent| the parent of the current and every later flag. A flag
+  // that already has a parent is invalidated and replaced lazily instead.
+  void SetParent(const FlagRef &parent) {
+    static_assert(!Threading::kConcurrent,
+                  "WeakGroup members must be single-sequence owners.");
+    if (ref_ && ref_->HasParent())
+      Invalidate();
+    parent_ = parent;
+    if (ref_ && parent_)
+      ref_->SetParent(parent_.get());
+  }
+
+  void Invalidate() {
+    if (!ref_)
+      return;
+#ifdef XLIB_WEAK_PTR_TRACING
+    WeakPtrTraceScope trace(WeakPtrTraceEvent::kInvalidate, ref_.get());
+#endif // XLIB_WEAK_PTR_TRACING
+    assert(flag()->CalledOnValidSequence());
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+    if (counters_)
+      WeakPtrCounters::Increment(counters_->invalidations);
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+    flag()->Invalidate();
+#ifdef XLIB_WEAK_PTR_MEMORY_ACCOUNTING
+    FlagHeapAccounting::Get().OnExpired(flag(), sizeof(Impl));
+#endif // XLIB_WEAK_PTR_MEMORY_ACCOUNTING
+    if (Threading::kHazardPins)
+      HazardDomain::Get().WaitUntilUnprotected(flag());
+    if (Threading::kConcurrent)
+      flag()->WaitForPins();
+    ref_.reset();
+  }
+
+  void DetachFromSequence() const {
+    if (ref_)
+      flag()->DetachFromSequence();
+  }
+
+  // Allocates the flag if needed so the binding applies to the WeakPtrs
+  // handed out afterwards too.
+  template <typename Token> void BindToSequence(const Token &token) {
+    GetRef();
+    flag()->BindToSequence(token);
+  }
+
+private:
+  FlagOwner(const FlagOwner &) = delete;
+  FlagOwner &operator=(const FlagOwner &) = delete;
+
+  using Impl = FlagImpl<Threading, Allocator>;
 
-  mutable std::thread::id valid_thread_id_ { std::this_thread::get_id(); };
-  mutable T mutex_;
+  Impl *flag() const { return static_cast<Impl *>(ref_.get()); }
+
+  FlagRef ref_;
+  FlagRef parent_;
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+  WeakPtrCounters *counters_ = nullptr;
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
 };
 
 } // namespace internal
 
-template <typename T, typename Threading> class SupportsWeakPtr;
-template <typename T, typename Threading> class WeakPtrFactory;
+template <typename T, typename Threading, typename Allocator>
+class SupportsWeakPtr;
+template <typename T, typename Threading, typename Allocator>
+class WeakPtrFactory;
+template <typename T> class WeakPtr;
+template <> class WeakPtr<void>;
+template <typename T> class WeakPin;
+
+namespace internal {
+
+// Gives containers built on top of WeakPtr (observer lists, maps, ...) access
+// to the flag and the cached address without widening WeakPtr's interface.
+struct WeakPtrAccess {
+  template <typename T>
+  static const FlagRef &GetFlag(const WeakPtr<T> &ptr) noexcept {
+    return ptr.ref_;
+  }
+  template <typename T>
+  static std::uintptr_t GetRaw(const WeakPtr<T> &ptr) noexcept {
+    return ptr.raw_ptr_;
+  }
+};
+
+} // namespace internal
 
 template <typename T> class WeakPtr {
 public:
-  WeakPtr() = default;
-  WeakPtr(std::nullptr_t) {}
+  // Usable for constant initialization of globals: no flag, no allocation.
+  constexpr WeakPtr() noexcept = default;
+  constexpr WeakPtr(std::nullptr_t) noexcept {}
+  WeakPtr(const WeakPtr &other) noexcept = default;
+  WeakPtr &operator=(const WeakPtr &other) noexcept = default;
 
-  template <typename U>
-  WeakPtr(const WeakPtr<U> &other)
-      : ptr_(other.ptr_), raw_ptr_(uintptr_cast<U, T>(other.raw_ptr_)),
-        threading_checker_(other.threading_checker_), ref_(other.ref_) {}
+  // Moves steal the flag reference and leave |other| null, so the reference
+  // count is never touched.
+  WeakPtr(WeakPtr &&other) noexcept
+      : ref_(std::move(other.ref_)), raw_ptr_(other.raw_ptr_) {
+    other.raw_ptr_ = 0;
+  }
+  WeakPtr &operator=(WeakPtr &&other) noexcept {
+    ref_ = std::move(other.ref_);
+    raw_ptr_ = other.raw_ptr_;
+    other.raw_ptr_ = 0;
+    return *this;
+  }
 
   template <typename U>
-  WeakPtr(const WeakPtr<U> &&other)
-      : ptr_(other.ptr_), raw_ptr_(uintptr_cast<U, T>(other.raw_ptr_)),
-        threading_checker_(other.threading_checker_), ref_(other.ref_) {}
+  WeakPtr(const WeakPtr<U> &other) noexcept
+      : ref_(other.ref_), raw_ptr_(uintptr_cast<U, T>(other.raw_ptr_)) {}
 
-  WeakPtr(const WeakPtr<void> &other)
-      : ptr_(other.ptr_), threading_checker_(other.threading_checker_),
-        ref_(other.ref_), raw_ptr_(uintptr_cast<void, T>(other.raw_ptr_)) {
-    if (raw_ptr == nullptr)
-      reset();
+  template <typename U>
+  WeakPtr(WeakPtr<U> &&other) noexcept
+      : ref_(std::move(other.ref_)),
+        raw_ptr_(uintptr_cast<U, T>(other.raw_ptr_)) {
+    other.raw_ptr_ = 0;
   }
 
-  template <typename U> WeakPtr<T> &operator=(const WeakPtr<U> &other) {
-    ptr_ = other.ptr_;
-    threading_checker_ = other.threading_checker_;
+  WeakPtr(const WeakPtr<void> &other) noexcept;
+
+  template <typename U>
+  WeakPtr<T> &operator=(const WeakPtr<U> &other) noexcept {
     ref_ = other.ref_;
     raw_ptr_ = uintptr_cast<U, T>(other.raw_ptr_);
     return *this;
   }
 
+  template <typename U> WeakPtr<T> &operator=(WeakPtr<U> &&other) noexcept {
+    ref_ = std::move(other.ref_);
+    raw_ptr_ = uintptr_cast<U, T>(other.raw_ptr_);
+    other.raw_ptr_ = 0;
+    return *this;
+  }
+
   template <typename U,
             typename std::enable_if<std::is_void<T>::value &&
                                     std::is_void<U>::value>::type * = nullptr>
-  bool equal(const WeakPtr<U> &other) {
+  bool equal(const WeakPtr<U> &other) const noexcept {
     return get() == other.get();
   }
 
   template <typename U,
             typename std::enable_if<!std::is_void<T>::value &&
                                     !std::is_void<U>::value>::type * = nullptr>
-  bool equal(const WeakPtr<U> &other) {
+  bool equal(const WeakPtr<U> &other) const noexcept {
     if (std::is_same<T, U>::value) {
       return get() == other.get();
     }
@@ -158,144 +825,418 @@ public:
   template <typename U,
             typename std::enable_if<!std::is_void<T>::value &&
                                     std::is_void<U>::value>::type * = nullptr>
-  bool equal(const WeakPtr<U> &other) {
+  bool equal(const WeakPtr<U> &other) const noexcept {
     return other.equal(WeakPtr<void>(*this));
   }
 
   template <typename U,
             typename std::enable_if<std::is_void<T>::value &&
                                     !std::is_void<U>::value>::type * = nullptr>
-  bool equal(const WeakPtr<U> &other) {
+  bool equal(const WeakPtr<U> &other) const noexcept {
     return equal(WeakPtr<void>(other));
   }
 
-  virtual T *get() const {
-    if (threading_checker_.expired())
-      return nullptr;
-    auto checker = threading_checker_.lock();
-    if (!checker)
+  // The owner invalidates the flag before the object goes away, so a single
+  // load of the validity bit is enough; no reference count is touched.
+  T *get() const noexcept {
+#ifdef XLIB_WEAK_PTR_TRACING
+    internal::WeakPtrTraceScope trace(WeakPtrTraceEvent::kGet, ref_.get());
+#endif // XLIB_WEAK_PTR_TRACING
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+    if (ref_)
+      ref_->CountGet(ref_->IsValid());
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+    if (!ref_.IsValid())
       return nullptr;
-    assert(checker->CalledOnValidSequence());
-    return ptr_.lock().get();
+    assert(ref_->CalledOnValidSequence());
+    return reinterpret_cast<T *>(raw_ptr_);
   }
-  operator T *() const { return get(); }
+  operator T *() const noexcept { return get(); }
 
   // std::enable_if_t<!std::is_void<T>::value, T&>
-  auto &operator*() const {
+  auto &operator*() const noexcept {
     assert(get() != nullptr);
     return *get();
   }
 
-  T *operator->() const {
+  T *operator->() const noexcept {
     assert(get() != nullptr);
     return get();
   }
   // Allow conditionals to test validity, e.g. if (weak_ptr) {...};
-  explicit operator bool() const { return get() != nullptr; }
+  explicit operator bool() const noexcept { return get() != nullptr; }
 
-  bool operator==(const WeakPtr<T> &other) const {
+  bool operator==(const WeakPtr<T> &other) const noexcept {
     return get() == other.get();
   }
-  bool operator!=(const WeakPtr<T> &other) const {
+  bool operator!=(const WeakPtr<T> &other) const noexcept {
     return get() != other.get();
   }
 
   // https://marknelson.us/posts/2011/09/03/hash-functions-for-c-unordered-containers.html
   template <typename U>
-  std::uintptr_t operator()(const WeakPtr<U> &other) const {
+  std::uintptr_t operator()(const WeakPtr<U> &other) const noexcept {
     return std::uintptr_t(other);
   }
 
-  operator std::uintptr_t() const { return raw_ptr_; }
+  constexpr operator std::uintptr_t() const noexcept { return raw_ptr_; }
 
-  void reset() {
-    threading_checker_.reset();
-    ptr_.reset();
+  void reset() noexcept {
     ref_.reset();
-    raw_ptr_ = nullptr;
+    raw_ptr_ = 0;
   }
 
-  bool is_null() const { return !get(); }
+  bool is_null() const noexcept { return !get(); }
+
+  // Validates once and returns a pin giving plain pointer access for its
+  // scope, instead of re-checking the flag on every ->, e.g.
+  //   if (auto pin = weak.Lock()) { pin->a(); pin->b(); pin->c(); }
+  // With the concurrent policies the pin also keeps the owner from finishing
+  // invalidation until it is gone, see WeakPin.
+  WeakPin<T> Lock() const;
 
   // User to guarantee the safely behavior of call interface by result.
   template <typename B, typename U> WeakPtr<U> StaticAsWeakPtr() {
-    static_assert(std::is_base_of<U, T>;; value || std::is_base_of<T, U>;;
-                  value, "T and U shouldn't has inherit relationship ");
-    static_assert(std::is_base_of<B, T>;; value && std::is_base_of<B, U>;;
-                  value, "T and U should inherit with same base.");
+    static_assert(std::is_base_of<U, T>::value || std::is_base_of<T, U>::value,
+                  "T and U shouldn't has inherit relationship ");
+    static_assert(std::is_base_of<B, T>::value && std::is_base_of<B, U>::value,
+                  "T and U should inherit with same base.");
     WeakPtr<U> user;
     user.ref_ = ref_;
-    user.threading_checker_ = threading_checker_;
-    user.ptr_ = ptr_;
     user.raw_ptr_ = raw_ptr_;
     return user;
   }
 
 private:
-  template <typename U, typename V> friend class SupportsWeakPtr;
-  template <typename T, typename V> friend class SupportsWeakPtr;
-  template <typename U, typename V> friend class WeakPtrFactory;
+  template <typename U, typename V, typename W> friend class SupportsWeakPtr;
+  template <typename U, typename V, typename W> friend class WeakPtrFactory;
   template <typename U> friend class WeakPtr;
-  WeakPtr(std::shared_ptr<T> ptr, std::shared_ptr<ThreadingChecker> flag,
-          std::shared_ptr<Flag> ref)
-      : ptr_(ptr), threading_checker_(flag), ref_(ref),
-        raw_ptr_(
-            uintptr_cast<T, T>(reinterpret_cast<std::uintptr_t>(ptr.get()))) {
+  friend struct internal::WeakPtrAccess;
+  WeakPtr(T *ptr, const internal::FlagRef &ref) noexcept
+      : ref_(ref), raw_ptr_(reinterpret_cast<std::uintptr_t>(ptr)) {
     assert(!std::is_void<T>::value); // "T must not void_t !!!");
   }
 
-  std::shared_ptr<Flag> ref_;
-  std::weak_ptr<ThreadingChecker<void>> threading_checker_;
-  std::weak_ptr<T> ptr_;
+  // Shared with the owner; carries validity and the threading checker.
+  internal::FlagRef ref_;
   std::uintptr_t raw_ptr_ = 0;
+
+public:
+  // Lets relocation-aware containers (e.g. folly::fbvector) move WeakPtrs
+  // with memcpy; both members are plain pointers.
+  using IsRelocatable = std::true_type;
 };
 
-template <> class WeakPtr<void> : public WeakPtr<std::uintptr_t> {
+// The type-erased WeakPtr: the same flag reference and address as any
+// WeakPtr<T>, and nothing else. Converting from WeakPtr<T> copies both words;
+// no cast, virtual call or RTTI is involved, so WeakPtr<void> is a cheap
+// identity key for routing tables. Converting back to WeakPtr<T> is
+// unchecked; use AnyWeakPtr (base/any_weak_ptr.h) to recover the type safely.
+template <> class WeakPtr<void> {
 public:
-  auto operator*() const -> std::enable_if_t<true, void> { assert(false); }
-  bool operator==(const WeakPtr<void> &other) const {
-    return this->get() == other.get();
+  constexpr WeakPtr() noexcept = default;
+  constexpr WeakPtr(std::nullptr_t) noexcept {}
+  WeakPtr(const WeakPtr &other) noexcept = default;
+  WeakPtr &operator=(const WeakPtr &other) noexcept = default;
+  WeakPtr(WeakPtr &&other) noexcept
+      : ref_(std::move(other.ref_)), raw_ptr_(other.raw_ptr_) {
+    other.raw_ptr_ = 0;
   }
-  bool operator<(const WeakPtr<void> &other) const {
-    return this->raw_ptr_ < other.raw_ptr_;
+  WeakPtr &operator=(WeakPtr &&other) noexcept {
+    ref_ = std::move(other.ref_);
+    raw_ptr_ = other.raw_ptr_;
+    other.raw_ptr_ = 0;
+    return *this;
   }
 
-  virtual std::uintptr_t *get() const override {
-    if (threading_checker_.expired())
-      return nullptr;
-    auto flag = threading_checker_.lock();
-    if (!flag)
+  // The address is the one the typed WeakPtr cached, i.e. that of the U
+  // subobject.
+  template <typename U>
+  WeakPtr(const WeakPtr<U> &other) noexcept
+      : ref_(other.ref_), raw_ptr_(other.raw_ptr_) {}
+  template <typename U>
+  WeakPtr(WeakPtr<U> &&other) noexcept
+      : ref_(std::move(other.ref_)), raw_ptr_(other.raw_ptr_) {
+    other.raw_ptr_ = 0;
+  }
+
+  void *get() const noexcept {
+#ifdef XLIB_WEAK_PTR_TRACING
+    internal::WeakPtrTraceScope trace(WeakPtrTraceEvent::kGet, ref_.get());
+#endif // XLIB_WEAK_PTR_TRACING
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+    if (ref_)
+      ref_->CountGet(ref_->IsValid());
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+    if (!ref_.IsValid())
       return nullptr;
-    assert(flag->CalledOnValidSequence());
-    return reinterpret_cast<std::uintptr_t *>(this->raw_ptr_);
+    assert(ref_->CalledOnValidSequence());
+    return reinterpret_cast<void *>(raw_ptr_);
+  }
+  explicit operator bool() const noexcept { return get() != nullptr; }
+
+  bool operator==(const WeakPtr &other) const noexcept {
+    return get() == other.get();
+  }
+  bool operator!=(const WeakPtr &other) const noexcept {
+    return get() != other.get();
+  }
+  // By address, without loading the flag.
+  bool operator<(const WeakPtr &other) const noexcept {
+    return raw_ptr_ < other.raw_ptr_;
   }
+
+  constexpr operator std::uintptr_t() const noexcept { return raw_ptr_; }
+
+  void reset() noexcept {
+    ref_.reset();
+    raw_ptr_ = 0;
+  }
+
+  bool is_null() const noexcept { return !get(); }
+
+private:
+  template <typename U> friend class WeakPtr;
+  friend struct internal::WeakPtrAccess;
+
+  internal::FlagRef ref_;
+  std::uintptr_t raw_ptr_ = 0;
+
+public:
+  using IsRelocatable = std::true_type;
 };
 
+template <typename T>
+WeakPtr<T>::WeakPtr(const WeakPtr<void> &other) noexcept
+    : ref_(other.ref_), raw_ptr_(uintptr_cast<void, T>(other.raw_ptr_)) {
+  if (raw_ptr_ == 0)
+    reset();
+}
+
+// A WeakPtr is one flag pointer plus one object pointer and has no vtable.
+template <typename T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+template <typename T>
+struct is_trivially_relocatable<WeakPtr<T>> : std::true_type {};
+
+static_assert(sizeof(WeakPtr<int>) == 2 * sizeof(void *),
+              "WeakPtr must stay two words.");
+static_assert(sizeof(WeakPtr<void>) == 2 * sizeof(void *),
+              "WeakPtr<void> must stay two words.");
+static_assert(!std::is_polymorphic<WeakPtr<int>>::value &&
+                  !std::is_polymorphic<WeakPtr<void>>::value,
+              "WeakPtr must not carry a vtable.");
+
+// Copying, moving, destroying and dereferencing never throw, so WeakPtrs can
+// be used from destructors and noexcept callbacks, and std::vector relocates
+// them with moves rather than copies. That includes the sequence checks
+// DEBUG builds run in get(): none of the threading policies throws from
+// CalledOnValidSequence(); a policy that did would call std::terminate().
+static_assert(std::is_nothrow_default_constructible<WeakPtr<int>>::value &&
+                  std::is_nothrow_copy_constructible<WeakPtr<int>>::value &&
+                  std::is_nothrow_move_constructible<WeakPtr<int>>::value &&
+                  std::is_nothrow_copy_assignable<WeakPtr<int>>::value &&
+                  std::is_nothrow_move_assignable<WeakPtr<int>>::value &&
+                  std::is_nothrow_destructible<WeakPtr<int>>::value,
+              "WeakPtr special members must be noexcept.");
+static_assert(std::is_nothrow_move_constructible<WeakPtr<void>>::value &&
+                  std::is_nothrow_move_assignable<WeakPtr<void>>::value &&
+                  std::is_nothrow_constructible<WeakPtr<void>,
+                                                const WeakPtr<int> &>::value,
+              "WeakPtr<void> conversions must be noexcept.");
+static_assert(
+    std::is_nothrow_constructible<WeakPtr<const int>, WeakPtr<int>>::value &&
+        std::is_nothrow_constructible<WeakPtr<const int>,
+                                      const WeakPtr<int> &>::value,
+    "Converting WeakPtrs must be noexcept.");
+static_assert(noexcept(std::declval<const WeakPtr<int> &>().get()) &&
+                  noexcept(static_cast<bool>(
+                      std::declval<const WeakPtr<int> &>())) &&
+                  noexcept(std::declval<const WeakPtr<int> &>() ==
+                           std::declval<const WeakPtr<int> &>()) &&
+                  noexcept(std::declval<const WeakPtr<int> &>().is_null()) &&
+                  noexcept(std::declval<WeakPtr<int> &>().reset()),
+              "WeakPtr observers must be noexcept.");
+
 // Allow callers to compare WeakPtrs against nullptr to test validity.
-template <class T> bool operator!=(const WeakPtr<T> &weak_ptr, std::nullptr_t) {
+template <class T>
+bool operator!=(const WeakPtr<T> &weak_ptr, std::nullptr_t) noexcept {
   return !(weak_ptr == nullptr);
 }
-template <class T> bool operator!=(std::nullptr_t, const WeakPtr<T> &weak_ptr) {
+template <class T>
+bool operator!=(std::nullptr_t, const WeakPtr<T> &weak_ptr) noexcept {
   return weak_ptr != nullptr;
 }
 
 template <class T>
-bool operator!=(const WeakPtr<T> &weak_ptr1, const WeakPtr<T> &weak_ptr2) {
+bool operator!=(const WeakPtr<T> &weak_ptr1,
+                const WeakPtr<T> &weak_ptr2) noexcept {
   return weak_ptr1.get() != weak_ptr2.get();
 }
 
-template <class T> bool operator==(const WeakPtr<T> &weak_ptr, std::nullptr_t) {
+template <class T>
+bool operator==(const WeakPtr<T> &weak_ptr, std::nullptr_t) noexcept {
   return weak_ptr.get() == nullptr;
 }
-template <class T> bool operator==(std::nullptr_t, const WeakPtr<T> &weak_ptr) {
+template <class T>
+bool operator==(std::nullptr_t, const WeakPtr<T> &weak_ptr) noexcept {
   return weak_ptr == nullptr;
 }
 
 template <class T>
-bool operator==(const WeakPtr<T> &weak_ptr1, const WeakPtr<T> &weak_ptr2) {
+bool operator==(const WeakPtr<T> &weak_ptr1,
+                const WeakPtr<T> &weak_ptr2) noexcept {
   return weak_ptr1.get() == weak_ptr2.get();
 }
 
+// Identity comparisons: by the cached address, then by the flag, without
+// loading either. Unlike operator==, WeakPtrs to one object stay equal after
+// it died, and a dead WeakPtr never equals one to a new object at the same
+// address. Raw pointers compare by address only, so a lookup by T* finds the
+// equal_range of every WeakPtr that was handed out for that address.
+struct WeakPtrIdentityLess {
+  using is_transparent = void;
+
+  template <typename T>
+  bool operator()(const WeakPtr<T> &lhs,
+                  const WeakPtr<T> &rhs) const noexcept {
+    const std::uintptr_t lhs_raw = internal::WeakPtrAccess::GetRaw(lhs);
+    const std::uintptr_t rhs_raw = internal::WeakPtrAccess::GetRaw(rhs);
+    if (lhs_raw != rhs_raw)
+      return lhs_raw < rhs_raw;
+    return std::less<const internal::Flag *>()(
+        internal::WeakPtrAccess::GetFlag(lhs).get(),
+        internal::WeakPtrAccess::GetFlag(rhs).get());
+  }
+  template <typename T>
+  bool operator()(const WeakPtr<T> &lhs, const T *rhs) const noexcept {
+    return internal::WeakPtrAccess::GetRaw(lhs) <
+           reinterpret_cast<std::uintptr_t>(rhs);
+  }
+  template <typename T>
+  bool operator()(const T *lhs, const WeakPtr<T> &rhs) const noexcept {
+    return reinterpret_cast<std::uintptr_t>(lhs) <
+           internal::WeakPtrAccess::GetRaw(rhs);
+  }
+};
+
+struct WeakPtrIdentityEqual {
+  template <typename T>
+  bool operator()(const WeakPtr<T> &lhs,
+                  const WeakPtr<T> &rhs) const noexcept {
+    return internal::WeakPtrAccess::GetRaw(lhs) ==
+               internal::WeakPtrAccess::GetRaw(rhs) &&
+           internal::WeakPtrAccess::GetFlag(lhs).get() ==
+               internal::WeakPtrAccess::GetFlag(rhs).get();
+  }
+};
+
+// Pins the object a WeakPtr points to for the pin's scope: validates once,
+// then gives plain pointer access. Readers on threads other than the owner's
+// use it with the concurrent policies, where InvalidateWeakPtrs() and thus
+// the owner's destruction wait for every pin to be released; never
+// invalidate while holding a pin on the same flag there. For single-sequence
+// owners a pin is just the validated pointer: the object can only go away
+// on the owner's sequence, i.e. not while the pin's scope runs unless that
+// scope destroys it.
+//
+// The owner holds on to the flag until every pin is released, so a pin may
+// outlive the WeakPtr it came from. Movable, not copyable.
+template <typename T> class WeakPin {
+public:
+  constexpr WeakPin() noexcept = default;
+  // Publishing the first hazard pin of a thread may allocate its record.
+  explicit WeakPin(const WeakPtr<T> &weak) {
+    const internal::FlagRef &ref = internal::WeakPtrAccess::GetFlag(weak);
+    if (!ref)
+      return;
+    if (!ref->IsConcurrent()) {
+      if (!ref->IsValid())
+        return;
+    } else {
+      if (ref->UsesHazardPins())
+        slot_ = internal::ThreadHazards::Protect(ref.get());
+      if (slot_) {
+        if (!ref->IsValid(std::memory_order_seq_cst)) {
+          internal::ThreadHazards::Clear(slot_);
+          slot_ = nullptr;
+          return;
+        }
+      } else if (!ref->TryPin()) {
+        return;
+      }
+      flag_ = ref.get();
+    }
+    assert(ref->CalledOnValidSequence());
+    ptr_ = reinterpret_cast<T *>(internal::WeakPtrAccess::GetRaw(weak));
+  }
+  WeakPin(WeakPin &&other) noexcept
+      : flag_(other.flag_), slot_(other.slot_), ptr_(other.ptr_) {
+    other.flag_ = nullptr;
+    other.slot_ = nullptr;
+    other.ptr_ = nullptr;
+  }
+  WeakPin &operator=(WeakPin &&other) noexcept {
+    if (this != &other) {
+      Release();
+      flag_ = other.flag_;
+      slot_ = other.slot_;
+      ptr_ = other.ptr_;
+      other.flag_ = nullptr;
+      other.slot_ = nullptr;
+      other.ptr_ = nullptr;
+    }
+    return *this;
+  }
+  ~WeakPin() { Release(); }
+
+  T *get() const noexcept { return ptr_; }
+  T &operator*() const noexcept {
+    assert(ptr_ != nullptr);
+    return *ptr_;
+  }
+  T *operator->() const noexcept {
+    assert(ptr_ != nullptr);
+    return ptr_;
+  }
+  explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+  // Releases the pin early.
+  void reset() noexcept {
+    Release();
+    flag_ = nullptr;
+    slot_ = nullptr;
+    ptr_ = nullptr;
+  }
+
+private:
+  WeakPin(const WeakPin &) = delete;
+  WeakPin &operator=(const WeakPin &) = delete;
+
+  void Release() noexcept {
+    if (slot_)
+      internal::ThreadHazards::Clear(slot_);
+    else if (flag_)
+      flag_->Unpin();
+  }
+
+  // Set only for pins of concurrent flags; |slot_| for hazard pins.
+  const internal::Flag *flag_ = nullptr;
+  internal::ThreadHazards::Slot *slot_ = nullptr;
+  T *ptr_ = nullptr;
+};
+
+template <typename T> WeakPin<T> WeakPtr<T>::Lock() const {
+  return WeakPin<T>(*this);
+}
+
+static_assert(std::is_nothrow_move_constructible<WeakPin<int>>::value &&
+                  std::is_nothrow_move_assignable<WeakPin<int>>::value &&
+                  !std::is_copy_constructible<WeakPin<int>>::value,
+              "WeakPin must be movable and not copyable.");
+
+// Public since the first release. The factories no longer use it; it stays
+// for callers that still need shared_from_this() through this name.
 template <typename T,
           typename std::enable_if<!std::is_void<T>::value>::type * = nullptr>
 std::shared_ptr<T> StaticAsWeakPtr(T *t) {
@@ -310,59 +1251,129 @@ std::shared_ptr<T> StaticAsWeakPtr(T *t) {
   return t->shared_from_this();
 }
 
-#ifdef DEBUG
-template <class T, typename Threading = ThreadingChecker<std::mutex>>
-#else
-template <class T, typename Threading = ThreadingChecker<void>>
-#endif // DEBUG
+// A parent flag shared by many owners, e.g. every object of a shard. Owners
+// join with JoinGroup(); InvalidateWeakPtrs() on the group then kills the
+// WeakPtrs of all members with a single atomic operation, however many there
+// are, and the members' own invalidations during teardown stay allocation
+// free. Invalidation is final for the flags that joined before it: members
+// that keep living call JoinGroup() again to hand out valid WeakPtrs.
+//
+// Observers of member flags (see FlagObserver) are notified as well, through
+// their flag, which observes the group's flag while it has observers. Members
+// must use a single-sequence policy and live on the group's sequence.
+template <typename Threading = internal::DefaultThreadingChecker,
+          typename Allocator = std::allocator<void>>
+class WeakGroup {
+public:
+  WeakGroup() = default;
+  ~WeakGroup() = default;
+
+  void InvalidateWeakPtrs() { flag_.Invalidate(); }
+
+private:
+  WeakGroup(const WeakGroup &) = delete;
+  WeakGroup &operator=(const WeakGroup &) = delete;
+
+  template <typename U, typename V, typename W> friend class WeakPtrFactory;
+  template <typename U, typename V, typename W> friend class SupportsWeakPtr;
+
+  internal::FlagOwner<Threading, Allocator> flag_;
+};
+
+// Hands out WeakPtrs to |ptr| whatever owns it: the stack, a unique_ptr, an
+// arena or a shared_ptr. Validity is the flag alone, so T needs no
+// enable_shared_from_this base, and a WeakPtr outliving the object keeps only
+// the small flag allocated, never the object's storage. Declare the factory
+// as the last member so it invalidates before the other members go away.
+//
+// Allocator selects where the flag lives, e.g. PooledFlagAllocator from
+// base/flag_pool.h; it must be stateless.
+template <class T, typename Threading = internal::DefaultThreadingChecker,
+          typename Allocator = std::allocator<void>>
 class WeakPtrFactory {
 public:
   explicit WeakPtrFactory(T *ptr) : ptr_(ptr) {
-    static_assert(std::is_base_of<std::enable_shared_from_this<T>, T>::value,
-                  "T isn't inherit from SupportsWeakPtr.");
-    // static_assert(
-    //    std::is_member_function_pointer<decltype(
-    //        &std::enable_shared_from_this<T>::shared_from_this)>::value,
-    //    "T::shared_from_this isn't a member function.");
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+    ref_.SetCounters(&internal::WeakPtrCounters::For<T>());
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
   }
   virtual ~WeakPtrFactory() = default;
   WeakPtr<T> GetWeakPtr() {
     assert(ptr_);
-    return WeakPtr<T>(StaticAsWeakPtr<T>(ptr_),
-                      std::dynamic_pointer_cast<Threading>(threading_), ref_);
+#ifdef XLIB_WEAK_PTR_TRACING
+    internal::WeakPtrTraceScope trace(WeakPtrTraceEvent::kGetWeakPtr,
+                                      ref_.current());
+#endif // XLIB_WEAK_PTR_TRACING
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+    ref_.CountWeakPtrCreated();
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+    return WeakPtr<T>(ptr_, ref_.GetRef());
   }
 
-  // Call this method to invalidate all existing weak pointers.
-  void InvalidateWeakPtrs() {
-    threading_ = std::make_shared<Threading>();
-    ref_ = nullptr;
+  // Call this method to invalidate all existing weak pointers. The next
+  // GetWeakPtr() allocates a fresh flag.
+  void InvalidateWeakPtrs() { ref_.Invalidate(); }
+
+  // Ties this factory's WeakPtrs to |group| as well, see WeakGroup.
+  template <typename GroupThreading, typename GroupAllocator>
+  void JoinGroup(WeakGroup<GroupThreading, GroupAllocator> &group) {
+    ref_.SetParent(group.flag_.GetRef());
   }
 
   // Call this method to determine if any weak pointers exist.
-  bool HasWeakPtrs() const { return Flag::HasRefs(ref_); }
+  bool HasWeakPtrs() const { return ref_.HasRefs(); }
+
+  // With Threading = ThreadingChecker<SequenceToken>: hands the owner and its
+  // weak pointers over to |token|'s sequence, e.g. right before posting the
+  // owner's next task there.
+  void BindToSequence(const SequenceToken &token) {
+    ref_.BindToSequence(token);
+  }
+
+  // Number of weak pointers handed out since the last InvalidateWeakPtrs()
+  // that are still alive. Both calls are one acquire load of the flag's
+  // reference count and never take a reference themselves.
+  //
+  // The count is exact while every WeakPtr lives on the owner's sequence.
+  // WeakPtrs copied or destroyed concurrently on other threads make it a
+  // snapshot; observing zero happens-after the last of them was released.
+  std::size_t WeakPtrCount() const { return ref_.WeakRefCount(); }
 
 private:
   WeakPtrFactory(const WeakPtrFactory &) = delete;
   WeakPtrFactory &operator=(const WeakPtrFactory &) = delete;
-  std::shared_ptr<Threading> threading_ = std::make_shared<Threading>();
-  Flag::flag_type ref_{Flag::GetRef()};
+  internal::FlagOwner<Threading, Allocator> ref_;
   T *ptr_ = nullptr;
 };
 
-#ifdef DEBUG
-template <class T, typename Threading = ThreadingChecker<std::mutex>>
-#else
-template <class T, typename Threading = ThreadingChecker<void>>
-#endif // DEBUG
+// Intrusive alternative to WeakPtrFactory. Its WeakPtrs don't depend on the
+// enable_shared_from_this base either; the base is kept so existing callers
+// of shared_from_this() keep working.
+//
+// With a concurrent policy, ~T() must call InvalidateWeakPtrs() first thing:
+// this base is destroyed after every member of T, too late to wait for the
+// WeakPins of other threads.
+template <class T, typename Threading = internal::DefaultThreadingChecker,
+          typename Allocator = std::allocator<void>>
 class SupportsWeakPtr : public std::enable_shared_from_this<T> {
 public:
   SupportsWeakPtr() {
-    static_assert(std::is_base_of<SupportsWeakPtr<T, Threading>, T>::value,
-                  "T isn't inherit from SupportsWeakPtr.");
+    static_assert(
+        std::is_base_of<SupportsWeakPtr<T, Threading, Allocator>, T>::value,
+        "T isn't inherit from SupportsWeakPtr.");
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+    ref_.SetCounters(&internal::WeakPtrCounters::For<T>());
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
   }
   WeakPtr<T> AsWeakPtr() {
-    return WeakPtr<T>(StaticAsWeakPtr<T>(static_cast<T *>(this)),
-                      std::dynamic_pointer_cast<Threading>(threading_), ref_);
+#ifdef XLIB_WEAK_PTR_TRACING
+    internal::WeakPtrTraceScope trace(WeakPtrTraceEvent::kGetWeakPtr,
+                                      ref_.current());
+#endif // XLIB_WEAK_PTR_TRACING
+#ifdef XLIB_WEAK_PTR_INSTRUMENTATION
+    ref_.CountWeakPtrCreated();
+#endif // XLIB_WEAK_PTR_INSTRUMENTATION
+    return WeakPtr<T>(static_cast<T *>(this), ref_.GetRef());
   }
 
   template <typename Derived> static WeakPtr<Derived> AsWeakPtr(Derived *t) {
@@ -371,31 +1382,56 @@ public:
     return WeakPtr<Derived>(t->AsWeakPtr());
   }
 
-  void HijackThread() { threading_->DetachFromSequence(); }
+  void HijackThread() { ref_.DetachFromSequence(); }
+
+  // See WeakPtrFactory::InvalidateWeakPtrs().
+  void InvalidateWeakPtrs() { ref_.Invalidate(); }
+
+  // See WeakPtrFactory::JoinGroup().
+  template <typename GroupThreading, typename GroupAllocator>
+  void JoinGroup(WeakGroup<GroupThreading, GroupAllocator> &group) {
+    ref_.SetParent(group.flag_.GetRef());
+  }
+
+  // See WeakPtrFactory::BindToSequence().
+  void BindToSequence(const SequenceToken &token) {
+    ref_.BindToSequence(token);
+  }
+
+  // See WeakPtrFactory::HasWeakPtrs()/WeakPtrCount().
+  bool HasWeakPtrs() const { return ref_.HasRefs(); }
+  std::size_t WeakPtrCount() const { return ref_.WeakRefCount(); }
 
 protected:
-  virtual ~SupportsWeakPtr() = default;
+  virtual ~SupportsWeakPtr() {
+    assert(!Threading::kConcurrent || !ref_.current());
+  }
 
 private:
   SupportsWeakPtr(const SupportsWeakPtr &) = delete;
   SupportsWeakPtr &operator=(const SupportsWeakPtr &) = delete;
-  std::shared_ptr<Threading> threading_ = std::make_shared<Threading>();
-  Flag::flag_type ref_{Flag::GetRef()};
+  internal::FlagOwner<Threading, Allocator> ref_;
 };
 
-template <> struct hash<std::WeakPtr<void>> {
-  std::size_t operator()(const std::WeakPtr<void> &obj) const {
+} // namespace xcpp
+
+namespace std {
+
+template <> struct hash<xcpp::WeakPtr<void>> {
+  std::size_t operator()(const xcpp::WeakPtr<void> &obj) const noexcept {
     return std::uintptr_t(obj);
   }
 };
 
-template <> struct equal_to<std::WeakPtr<void>> {
-  bool operator()(const std::WeakPtr<void> &u,
-                  const std::WeakPtr<void> &v) const {
-    return u == v;
+// Identity, like xcpp::WeakPtrIdentityEqual: keys stay equal to themselves
+// after their object died, in line with the address hash above.
+template <> struct equal_to<xcpp::WeakPtr<void>> {
+  bool operator()(const xcpp::WeakPtr<void> &u,
+                  const xcpp::WeakPtr<void> &v) const noexcept {
+    return xcpp::WeakPtrIdentityEqual()(u, v);
   }
 };
 
-} // namespace xcpp
+} // namespace std
 
 #endif // !XLIB_BASE_WEAK_PTR_INCLUDE_H_
@@ -0,0 +1,135 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_WEAK_PTR_MEMORY_INCLUDE_H_
+#define XLIB_BASE_WEAK_PTR_MEMORY_INCLUDE_H_
+
+#include <atomic>
+#include <cstddef>
+
+// Heap accounting for weak pointer flags. Only collected when the build
+// defines XLIB_WEAK_PTR_MEMORY_ACCOUNTING (CMake option of the same name);
+// otherwise the stats stay zero and the hook is never called.
+
+namespace xcpp {
+
+// Every owner that handed out a WeakPtr holds exactly one flag allocation;
+// the threading checker lives inside it. Once the owner invalidates, the flag
+// is expired and stays allocated only while WeakPtrs still reference it.
+struct WeakPtrMemoryStats {
+  std::size_t live_flags = 0;
+  std::size_t live_bytes = 0;
+  std::size_t expired_flags = 0;
+  std::size_t expired_bytes = 0;
+  // The part of live_bytes + expired_bytes taken by threading checkers.
+  std::size_t checker_bytes = 0;
+
+  std::size_t total_bytes() const { return live_bytes + expired_bytes; }
+};
+
+enum class FlagHeapEvent { kAllocated, kExpired, kFreed };
+
+// Called on the thread that allocates, invalidates or frees a flag, e.g. to
+// tag the block in a heap profiler. Must not create or destroy flags itself.
+using FlagHeapHook = void (*)(FlagHeapEvent event, const void *flag,
+                              std::size_t size);
+
+namespace internal {
+
+class FlagHeapAccounting {
+public:
+  static FlagHeapAccounting &Get() {
+    static FlagHeapAccounting *accounting = new FlagHeapAccounting;
+    return *accounting;
+  }
+
+  void OnAllocated(const void *flag, std::size_t size,
+                   std::size_t checker_size) {
+    Add(allocated_, 1);
+    Add(allocated_bytes_, size);
+    Add(allocated_checker_bytes_, checker_size);
+    Notify(FlagHeapEvent::kAllocated, flag, size);
+  }
+  void OnExpired(const void *flag, std::size_t size) {
+    Add(expired_, 1);
+    Add(expired_bytes_, size);
+    Notify(FlagHeapEvent::kExpired, flag, size);
+  }
+  void OnFreed(const void *flag, std::size_t size, std::size_t checker_size) {
+    Notify(FlagHeapEvent::kFreed, flag, size);
+    Add(freed_, 1);
+    Add(freed_bytes_, size);
+    Add(freed_checker_bytes_, checker_size);
+  }
+
+  void SetHook(FlagHeapHook hook) {
+    hook_.store(hook, std::memory_order_release);
+  }
+
+  // Counters are read one by one while other threads move on, so clamp
+  // rather than wrap.
+  WeakPtrMemoryStats Snapshot() const {
+    const std::size_t freed = Load(freed_);
+    const std::size_t freed_bytes = Load(freed_bytes_);
+    const std::size_t expired = Load(expired_);
+    const std::size_t expired_bytes = Load(expired_bytes_);
+    const std::size_t allocated = Load(allocated_);
+    const std::size_t allocated_bytes = Load(allocated_bytes_);
+    WeakPtrMemoryStats stats;
+    stats.live_flags = Difference(allocated, expired);
+    stats.live_bytes = Difference(allocated_bytes, expired_bytes);
+    stats.expired_flags = Difference(expired, freed);
+    stats.expired_bytes = Difference(expired_bytes, freed_bytes);
+    stats.checker_bytes =
+        Difference(Load(allocated_checker_bytes_), Load(freed_checker_bytes_));
+    return stats;
+  }
+
+private:
+  FlagHeapAccounting() = default;
+
+  static void Add(std::atomic<std::size_t> &counter, std::size_t value) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+  static std::size_t Load(const std::atomic<std::size_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+  }
+  static std::size_t Difference(std::size_t lhs, std::size_t rhs) {
+    return lhs > rhs ? lhs - rhs : 0;
+  }
+
+  void Notify(FlagHeapEvent event, const void *flag, std::size_t size) const {
+    if (FlagHeapHook hook = hook_.load(std::memory_order_acquire))
+      hook(event, flag, size);
+  }
+
+  std::atomic<std::size_t> allocated_{0};
+  std::atomic<std::size_t> allocated_bytes_{0};
+  std::atomic<std::size_t> allocated_checker_bytes_{0};
+  std::atomic<std::size_t> expired_{0};
+  std::atomic<std::size_t> expired_bytes_{0};
+  std::atomic<std::size_t> freed_{0};
+  std::atomic<std::size_t> freed_bytes_{0};
+  std::atomic<std::size_t> freed_checker_bytes_{0};
+  std::atomic<FlagHeapHook> hook_{nullptr};
+};
+
+} // namespace internal
+
+inline WeakPtrMemoryStats GetWeakPtrMemoryStats() {
+  return internal::FlagHeapAccounting::Get().Snapshot();
+}
+
+// Pass null to remove the hook.
+inline void SetFlagHeapHook(FlagHeapHook hook) {
+  internal::FlagHeapAccounting::Get().SetHook(hook);
+}
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_WEAK_PTR_MEMORY_INCLUDE_H_
@@ -0,0 +1,191 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_WEAK_PTR_STATS_INCLUDE_H_
+#define XLIB_BASE_WEAK_PTR_STATS_INCLUDE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+// Per-type weak pointer counters. Only collected when the build defines
+// XLIB_WEAK_PTR_INSTRUMENTATION (CMake option of the same name); otherwise no
+// counter exists anywhere and the snapshot below is simply empty.
+
+namespace xcpp {
+
+// Counters of one owner type, i.e. the T of WeakPtrFactory<T> or
+// SupportsWeakPtr<T>. Derefs are attributed to the owner through the flag, no
+// matter which WeakPtr<Base> they went through.
+struct WeakPtrTypeStats {
+  std::string type_name;
+  std::uint64_t weak_ptrs_created = 0;
+  std::uint64_t gets = 0;
+  std::uint64_t failed_gets = 0;
+  std::uint64_t invalidations = 0;
+  std::uint64_t flags_created = 0;
+  std::uint64_t flags_destroyed = 0;
+  // Summed over destroyed flags, from creation until the last reference.
+  std::uint64_t flag_lifetime_ns = 0;
+};
+
+namespace internal {
+
+// Relaxed counters, one static instance per owner type, linked into a global
+// list on first use.
+class WeakPtrCounters {
+public:
+  template <typename T> static WeakPtrCounters &For() {
+    static WeakPtrCounters *counters = new WeakPtrCounters(TypeName<T>());
+    return *counters;
+  }
+
+  static WeakPtrCounters *First() {
+    return Head().load(std::memory_order_acquire);
+  }
+  WeakPtrCounters *next() const { return next_; }
+
+  static void Increment(std::atomic<std::uint64_t> &counter,
+                        std::uint64_t value = 1) {
+    counter.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  WeakPtrTypeStats Snapshot() const {
+    WeakPtrTypeStats stats;
+    stats.type_name = type_name_;
+    stats.weak_ptrs_created =
+        weak_ptrs_created.load(std::memory_order_relaxed);
+    stats.gets = gets.load(std::memory_order_relaxed);
+    stats.failed_gets = failed_gets.load(std::memory_order_relaxed);
+    stats.invalidations = invalidations.load(std::memory_order_relaxed);
+    stats.flags_created = flags_created.load(std::memory_order_relaxed);
+    stats.flags_destroyed = flags_destroyed.load(std::memory_order_relaxed);
+    stats.flag_lifetime_ns = flag_lifetime_ns.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  std::atomic<std::uint64_t> weak_ptrs_created{0};
+  std::atomic<std::uint64_t> gets{0};
+  std::atomic<std::uint64_t> failed_gets{0};
+  std::atomic<std::uint64_t> invalidations{0};
+  std::atomic<std::uint64_t> flags_created{0};
+  std::atomic<std::uint64_t> flags_destroyed{0};
+  std::atomic<std::uint64_t> flag_lifetime_ns{0};
+
+private:
+  explicit WeakPtrCounters(std::string type_name)
+      : type_name_(std::move(type_name)) {
+    WeakPtrCounters *head = Head().load(std::memory_order_relaxed);
+    do {
+      next_ = head;
+    } while (!Head().compare_exchange_weak(head, this,
+                                           std::memory_order_release,
+                                           std::memory_order_relaxed));
+  }
+
+  static std::atomic<WeakPtrCounters *> &Head() {
+    static std::atomic<WeakPtrCounters *> head{nullptr};
+    return head;
+  }
+
+  // Readable names without RTTI where the compiler spells T out for us.
+  template <typename T> static std::string TypeName() {
+#if defined(__clang__) || defined(__GNUC__)
+    const std::string function = __PRETTY_FUNCTION__;
+    const std::size_t begin = function.find("T = ");
+    if (begin != std::string::npos) {
+      const std::size_t end = function.find_first_of(";]", begin);
+      return function.substr(begin + 4, end - begin - 4);
+    }
+#endif
+    return typeid(T).name();
+  }
+
+  const std::string type_name_;
+  WeakPtrCounters *next_ = nullptr;
+};
+
+inline void AppendJsonString(std::string *out, const std::string &value) {
+  out->push_back('"');
+  for (char c : value) {
+    if (c == '"' || c == '\\')
+      out->push_back('\\');
+    out->push_back(c);
+  }
+  out->push_back('"');
+}
+
+} // namespace internal
+
+// Snapshot of every owner type seen so far, most recently registered first.
+inline std::vector<WeakPtrTypeStats> GetWeakPtrStats() {
+  std::vector<WeakPtrTypeStats> stats;
+  for (auto *counters = internal::WeakPtrCounters::First(); counters;
+       counters = counters->next())
+    stats.push_back(counters->Snapshot());
+  return stats;
+}
+
+// One line per type, e.g. for a debug page.
+inline std::string DumpWeakPtrStats() {
+  std::string out;
+  char line[256];
+  for (const auto &stats : GetWeakPtrStats()) {
+    std::snprintf(line, sizeof(line),
+                  " created=%llu gets=%llu failed_gets=%llu invalidations=%llu"
+                  " flags=%llu/%llu flag_lifetime_ns=%llu\n",
+                  static_cast<unsigned long long>(stats.weak_ptrs_created),
+                  static_cast<unsigned long long>(stats.gets),
+                  static_cast<unsigned long long>(stats.failed_gets),
+                  static_cast<unsigned long long>(stats.invalidations),
+                  static_cast<unsigned long long>(stats.flags_destroyed),
+                  static_cast<unsigned long long>(stats.flags_created),
+                  static_cast<unsigned long long>(stats.flag_lifetime_ns));
+    out += stats.type_name;
+    out += line;
+  }
+  return out;
+}
+
+// A JSON array with one object per type, field names as in WeakPtrTypeStats.
+inline std::string DumpWeakPtrStatsJson() {
+  std::string out = "[";
+  char fields[320];
+  bool first = true;
+  for (const auto &stats : GetWeakPtrStats()) {
+    if (!first)
+      out += ",";
+    first = false;
+    out += "{\"type_name\":";
+    internal::AppendJsonString(&out, stats.type_name);
+    std::snprintf(
+        fields, sizeof(fields),
+        ",\"weak_ptrs_created\":%llu,\"gets\":%llu,\"failed_gets\":%llu,"
+        "\"invalidations\":%llu,\"flags_created\":%llu,"
+        "\"flags_destroyed\":%llu,\"flag_lifetime_ns\":%llu}",
+        static_cast<unsigned long long>(stats.weak_ptrs_created),
+        static_cast<unsigned long long>(stats.gets),
+        static_cast<unsigned long long>(stats.failed_gets),
+        static_cast<unsigned long long>(stats.invalidations),
+        static_cast<unsigned long long>(stats.flags_created),
+        static_cast<unsigned long long>(stats.flags_destroyed),
+        static_cast<unsigned long long>(stats.flag_lifetime_ns));
+    out += fields;
+  }
+  out += "]";
+  return out;
+}
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_WEAK_PTR_STATS_INCLUDE_H_
@@ -0,0 +1,315 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef XLIB_BASE_WEAK_PTR_TRACE_INCLUDE_H_
+#define XLIB_BASE_WEAK_PTR_TRACE_INCLUDE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Sampled timings of WeakPtr::get(), GetWeakPtr()/AsWeakPtr() and
+// InvalidateWeakPtrs(). Only recorded when the build defines
+// XLIB_WEAK_PTR_TRACING (CMake option of the same name); otherwise none of
+// the hooks exists, base/weak_ptr.h doesn't include this header, and
+// draining simply yields nothing.
+//
+// Each thread writes its samples into a ring of its own without any atomic
+// read-modify-write; a full ring drops samples rather than blocking. Drain
+// them periodically, e.g. into a Perfetto or Chrome trace exporter.
+
+namespace xcpp {
+
+enum class WeakPtrTraceEvent : std::uint8_t { kGet, kGetWeakPtr, kInvalidate };
+
+struct WeakPtrTraceRecord {
+  WeakPtrTraceEvent event;
+  // Identifies the recording ring; rings are reused once their thread exits.
+  std::uint32_t thread_id;
+  // The flag involved, to correlate samples of one owner. Null for get() on
+  // a null WeakPtr and for the first GetWeakPtr() of an owner.
+  const void *flag;
+  // Since an arbitrary process-wide epoch.
+  std::uint64_t start_ns;
+  std::uint64_t duration_ns;
+};
+
+namespace internal {
+
+constexpr std::size_t kWeakPtrTraceRingSize = 4096;
+
+// rdtsc where available, steady_clock otherwise. The TSC isn't serializing,
+// which is fine at this sampling granularity.
+class WeakPtrTraceClock {
+public:
+  static std::uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  // Calibrated against steady_clock on first use, which takes ~10ms; only
+  // draining calls it.
+  static double NanosecondsPerTick() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const double ns_per_tick = [] {
+      const auto wall_start = std::chrono::steady_clock::now();
+      const std::uint64_t start = Now();
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      const std::uint64_t ticks = Now() - start;
+      const double ns = std::chrono::duration<double, std::nano>(
+                            std::chrono::steady_clock::now() - wall_start)
+                            .count();
+      return ticks ? ns / ticks : 1.0;
+    }();
+    return ns_per_tick;
+#else
+    return 1.0;
+#endif
+  }
+};
+
+// Single-producer single-consumer ring: the owning thread appends, drains
+// consume under the registry's mutex. Rings are never freed.
+class WeakPtrTraceRing {
+public:
+  struct Sample {
+    WeakPtrTraceEvent event;
+    const void *flag;
+    std::uint64_t start;
+    std::uint64_t duration;
+  };
+
+  explicit WeakPtrTraceRing(std::uint32_t id) : id_(id) {}
+
+  void Append(WeakPtrTraceEvent event, const void *flag, std::uint64_t start,
+              std::uint64_t duration) {
+    const std::uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == kWeakPtrTraceRingSize) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    samples_[head % kWeakPtrTraceRingSize] = {event, flag, start, duration};
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  template <typename Function> void Consume(Function &&function) {
+    std::uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const std::uint64_t head = head_.load(std::memory_order_acquire);
+    for (; tail != head; ++tail)
+      function(samples_[tail % kWeakPtrTraceRingSize]);
+    tail_.store(tail, std::memory_order_release);
+  }
+
+  // The owning thread's sampling countdown.
+  std::uint32_t countdown = 1;
+
+  std::atomic<bool> in_use{true};
+  WeakPtrTraceRing *next = nullptr;
+  std::uint32_t id() const { return id_; }
+  std::uint64_t dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+private:
+  const std::uint32_t id_;
+  std::atomic<std::uint64_t> head_{0};
+  std::atomic<std::uint64_t> tail_{0};
+  std::atomic<std::uint64_t> dropped_{0};
+  Sample samples_[kWeakPtrTraceRingSize];
+};
+
+// Every ring ever created, recycled when their thread exits.
+class WeakPtrTraceRegistry {
+public:
+  static WeakPtrTraceRegistry &Get() {
+    static WeakPtrTraceRegistry *registry = new WeakPtrTraceRegistry;
+    return *registry;
+  }
+
+  WeakPtrTraceRing *AcquireRing() {
+    for (WeakPtrTraceRing *ring = head_.load(std::memory_order_acquire); ring;
+         ring = ring->next) {
+      bool expected = false;
+      if (!ring->in_use.load(std::memory_order_relaxed) &&
+          ring->in_use.compare_exchange_strong(expected, true,
+                                               std::memory_order_acquire))
+        return ring;
+    }
+    auto *ring = new WeakPtrTraceRing(
+        next_id_.fetch_add(1, std::memory_order_relaxed));
+    WeakPtrTraceRing *head = head_.load(std::memory_order_relaxed);
+    do {
+      ring->next = head;
+    } while (!head_.compare_exchange_weak(head, ring,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+    return ring;
+  }
+
+  void ReleaseRing(WeakPtrTraceRing *ring) {
+    ring->in_use.store(false, std::memory_order_release);
+  }
+
+  WeakPtrTraceRing *First() const {
+    return head_.load(std::memory_order_acquire);
+  }
+  std::mutex &drain_mutex() { return drain_mutex_; }
+
+  // Record one in every |every| calls per thread; 1 records all of them.
+  void SetSampling(std::uint32_t every) {
+    sample_every_.store(every ? every : 1, std::memory_order_relaxed);
+  }
+  std::uint32_t sample_every() const {
+    return sample_every_.load(std::memory_order_relaxed);
+  }
+
+private:
+  WeakPtrTraceRegistry() = default;
+
+  std::atomic<WeakPtrTraceRing *> head_{nullptr};
+  std::atomic<std::uint32_t> next_id_{1};
+  std::atomic<std::uint32_t> sample_every_{64};
+  std::mutex drain_mutex_;
+};
+
+// The calling thread's ring, acquired on first use and handed back when the
+// thread exits. Null while the thread is shutting down.
+class ThreadWeakPtrTrace {
+public:
+  static WeakPtrTraceRing *LocalRing() {
+    thread_local State state = State::kUnset;
+    if (state == State::kDead)
+      return nullptr;
+    thread_local Holder holder(&state);
+    return holder.ring;
+  }
+
+private:
+  enum class State : unsigned char { kUnset, kLive, kDead };
+
+  struct Holder {
+    explicit Holder(State *state)
+        : state(state), ring(WeakPtrTraceRegistry::Get().AcquireRing()) {
+      *state = State::kLive;
+    }
+    ~Holder() {
+      WeakPtrTraceRegistry::Get().ReleaseRing(ring);
+      *state = State::kDead;
+    }
+
+    State *state;
+    WeakPtrTraceRing *ring;
+  };
+};
+
+// Times its scope if the calling thread's countdown says so. Unsampled
+// scopes cost one thread_local lookup and a decrement.
+class WeakPtrTraceScope {
+public:
+  WeakPtrTraceScope(WeakPtrTraceEvent event, const void *flag)
+      : event_(event), flag_(flag) {
+    WeakPtrTraceRing *ring = ThreadWeakPtrTrace::LocalRing();
+    if (!ring || --ring->countdown)
+      return;
+    ring->countdown = WeakPtrTraceRegistry::Get().sample_every();
+    ring_ = ring;
+    start_ = WeakPtrTraceClock::Now();
+  }
+  ~WeakPtrTraceScope() {
+    if (ring_)
+      ring_->Append(event_, flag_, start_, WeakPtrTraceClock::Now() - start_);
+  }
+
+  WeakPtrTraceScope(const WeakPtrTraceScope &) = delete;
+  WeakPtrTraceScope &operator=(const WeakPtrTraceScope &) = delete;
+
+private:
+  const WeakPtrTraceEvent event_;
+  const void *const flag_;
+  WeakPtrTraceRing *ring_ = nullptr;
+  std::uint64_t start_ = 0;
+};
+
+} // namespace internal
+
+// Default 64: one call in 64 per thread is timed.
+inline void SetWeakPtrTraceSampling(std::uint32_t every) {
+  internal::WeakPtrTraceRegistry::Get().SetSampling(every);
+}
+
+// Moves every sample recorded so far to |out|, oldest first per thread.
+// Returns the number appended. Safe to call from any thread.
+inline std::size_t DrainWeakPtrTrace(std::vector<WeakPtrTraceRecord> *out) {
+  auto &registry = internal::WeakPtrTraceRegistry::Get();
+  std::lock_guard<std::mutex> lock(registry.drain_mutex());
+  const double ns_per_tick = internal::WeakPtrTraceClock::NanosecondsPerTick();
+  const std::size_t old_size = out->size();
+  for (auto *ring = registry.First(); ring; ring = ring->next) {
+    ring->Consume([&](const internal::WeakPtrTraceRing::Sample &sample) {
+      out->push_back({sample.event, ring->id(), sample.flag,
+                      static_cast<std::uint64_t>(sample.start * ns_per_tick),
+                      static_cast<std::uint64_t>(sample.duration *
+                                                 ns_per_tick)});
+    });
+  }
+  return out->size() - old_size;
+}
+
+// Samples lost to full rings since startup.
+inline std::uint64_t GetWeakPtrTraceDropped() {
+  std::uint64_t dropped = 0;
+  for (auto *ring = internal::WeakPtrTraceRegistry::Get().First(); ring;
+       ring = ring->next)
+    dropped += ring->dropped();
+  return dropped;
+}
+
+// Drains into the Chrome trace event format: {"traceEvents":[...]} with one
+// complete ("X") event per sample, loadable by chrome://tracing and Perfetto.
+inline std::string DumpWeakPtrTraceJson() {
+  static const char *const kNames[] = {"WeakPtr::get", "GetWeakPtr",
+                                       "InvalidateWeakPtrs"};
+  std::vector<WeakPtrTraceRecord> records;
+  DrainWeakPtrTrace(&records);
+  std::string out = "{\"traceEvents\":[";
+  char event[256];
+  bool first = true;
+  for (const auto &record : records) {
+    std::snprintf(event, sizeof(event),
+                  "%s{\"name\":\"%s\",\"cat\":\"xlib\",\"ph\":\"X\","
+                  "\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%u,"
+                  "\"args\":{\"flag\":\"%p\"}}",
+                  first ? "" : ",",
+                  kNames[static_cast<int>(record.event)],
+                  record.start_ns / 1000.0, record.duration_ns / 1000.0,
+                  static_cast<unsigned>(record.thread_id), record.flag);
+    out += event;
+    first = false;
+  }
+  out += "]}";
+  return out;
+}
+
+} // namespace xcpp
+
+#endif // !XLIB_BASE_WEAK_PTR_TRACE_INCLUDE_H_
@@ -0,0 +1,53 @@
+# Checks the assembly of bench/weak_ptr_get_codegen.cc. Run as
+#   cmake -DASM=<file.s> -DSTAMP=<file> -P check_get_codegen.cmake
+#
+# A release get() is: load the flag, branch if null, load its state, branch
+# if invalidated, load the group parent, branch, load the raw pointer. Any
+# call, locked instruction or fence means something stopped inlining or an
+# ordering got stronger than the acquire load it should be. So does a jump
+# or branch anywhere but a local label: a tail call is a call as well.
+
+set(kMaxInstructions 20)
+
+file(STRINGS "${ASM}" lines)
+set(in_function FALSE)
+set(instructions 0)
+set(body "")
+foreach(line IN LISTS lines)
+  if(line MATCHES "^_?xlib_weak_ptr_get_codegen:")
+    set(in_function TRUE)
+  elseif(in_function)
+    if(line MATCHES "^[ \t]*\\.(size|cfi_endproc)" OR line MATCHES "^[^ \t.]")
+      break()
+    endif()
+    if(line MATCHES "^[ \t]+[a-z]")
+      math(EXPR instructions "${instructions} + 1")
+      string(APPEND body "${line}\n")
+      if(line MATCHES "^[ \t]+(call|bl|blr|lock|mfence|dmb|xchg)[ \t;]")
+        message(FATAL_ERROR
+          "WeakPtr<T>::get() codegen regressed, found:${line}\n${body}")
+      endif()
+      # x86 j*, AArch64 b, br, b.<cond>, cb(n)z and tb(n)z. The target is
+      # the last operand and must be a local label (.L on ELF, L on Mach-O).
+      set(branch "j[a-z]*|b|br|b\\.[a-z]+|cbn?z|tbn?z")
+      if(line MATCHES "^[ \t]+(${branch})[ \t]+([^;]*)")
+        string(STRIP "${CMAKE_MATCH_2}" operands)
+        string(REGEX REPLACE ".*[, \t]" "" target "${operands}")
+        if(NOT target MATCHES "^\\.?L")
+          message(FATAL_ERROR
+            "WeakPtr<T>::get() branches out of the function:${line}\n${body}")
+        endif()
+      endif()
+    endif()
+  endif()
+endforeach()
+
+if(instructions EQUAL 0)
+  message(FATAL_ERROR "xlib_weak_ptr_get_codegen not found in ${ASM}")
+endif()
+if(instructions GREATER kMaxInstructions)
+  message(FATAL_ERROR "WeakPtr<T>::get() grew to ${instructions} "
+    "instructions (limit ${kMaxInstructions}):\n${body}")
+endif()
+
+file(WRITE "${STAMP}" "${instructions}\n")
@@ -0,0 +1,60 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// Compiled as C++20 only, never linked: the rest of the tree is C++14, where
+// base/weak_guard.h is empty, so this keeps both awaiters building.
+
+#include <cstdlib>
+#include <utility>
+
+#include "base/weak_guard.h"
+
+#ifndef XLIB_HAS_WEAK_GUARD
+#error "base/weak_guard.h should be available in C++20 builds."
+#endif
+
+// Named rather than anonymous, so the coroutine below has external linkage
+// and isn't reported as unused.
+namespace xlib_weak_guard_compile_internal {
+
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::abort(); }
+  };
+};
+
+struct Connection {
+  void OnReadable(xcpp::WeakResumer wake) { pending = std::move(wake); }
+
+  int reads = 0;
+  xcpp::WeakResumer pending;
+  xcpp::WeakPtrFactory<Connection> weak_factory{this};
+};
+
+} // namespace xlib_weak_guard_compile_internal
+
+using xlib_weak_guard_compile_internal::Connection;
+using xlib_weak_guard_compile_internal::Detached;
+
+Detached xlib_weak_guard_compile(xcpp::WeakPtr<Connection> weak) {
+  Connection *self = co_await xcpp::weak_guard(weak);
+  ++self->reads;
+  for (auto cancel : {xcpp::WeakGuardCancel::kOnResume,
+                      xcpp::WeakGuardCancel::kOnInvalidate}) {
+    self = co_await xcpp::weak_guard(
+        weak, [self](xcpp::WeakResumer wake) {
+          self->OnReadable(std::move(wake));
+        },
+        cancel);
+    ++self->reads;
+  }
+}
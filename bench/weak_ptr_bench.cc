@@ -0,0 +1,424 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// WeakPtr hot paths next to the equivalent std::weak_ptr operations. The
+// threaded variants share one factory, whose flag is created up front so the
+// threads only contend on its reference count.
+
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "base/any_weak_ptr.h"
+#include "base/bind_weak.h"
+#include "base/flag_pool.h"
+#include "base/generational_weak_ptr.h"
+#include "base/weak_key_map.h"
+#include "base/weak_ptr.h"
+
+namespace {
+
+constexpr int kMaxThreads = 8;
+
+struct Base {
+  virtual ~Base() = default;
+  int value = 1;
+};
+
+struct Derived : public Base, public std::enable_shared_from_this<Derived> {
+  void Add(int a, int b) { value += a + b; }
+
+  // The threaded benchmarks share one target across threads, which the
+  // DEBUG default policy would reject; none of them invalidates.
+  xcpp::WeakPtrFactory<Derived, xcpp::internal::ThreadingChecker<void>>
+      weak_factory{this};
+};
+
+Derived &SharedTarget() {
+  static Derived *target = [] {
+    auto *derived = new Derived;
+    derived->weak_factory.GetWeakPtr();
+    return derived;
+  }();
+  return *target;
+}
+
+const std::shared_ptr<Derived> &SharedStdTarget() {
+  static auto *target = new std::shared_ptr<Derived>(new Derived);
+  return *target;
+}
+
+void BM_GetWeakPtr(benchmark::State &state) {
+  Derived &target = SharedTarget();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(target.weak_factory.GetWeakPtr());
+}
+BENCHMARK(BM_GetWeakPtr)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+void BM_StdWeakPtrFromShared(benchmark::State &state) {
+  const std::shared_ptr<Derived> &target = SharedStdTarget();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(std::weak_ptr<Derived>(target));
+}
+BENCHMARK(BM_StdWeakPtrFromShared)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+void BM_Get(benchmark::State &state) {
+  xcpp::WeakPtr<Derived> weak = SharedTarget().weak_factory.GetWeakPtr();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(weak.get());
+}
+BENCHMARK(BM_Get)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+void BM_Arrow(benchmark::State &state) {
+  xcpp::WeakPtr<Derived> weak = SharedTarget().weak_factory.GetWeakPtr();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(weak->value);
+}
+BENCHMARK(BM_Arrow)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+// Three member accesses: re-validated each time through ->, once via Lock().
+void BM_ArrowRepeated(benchmark::State &state) {
+  xcpp::WeakPtr<Derived> weak = SharedTarget().weak_factory.GetWeakPtr();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(weak->value);
+    benchmark::DoNotOptimize(weak->value);
+    benchmark::DoNotOptimize(weak->value);
+  }
+}
+BENCHMARK(BM_ArrowRepeated);
+
+void BM_LockRepeated(benchmark::State &state) {
+  xcpp::WeakPtr<Derived> weak = SharedTarget().weak_factory.GetWeakPtr();
+  for (auto _ : state) {
+    auto pin = weak.Lock();
+    benchmark::DoNotOptimize(pin->value);
+    benchmark::DoNotOptimize(pin->value);
+    benchmark::DoNotOptimize(pin->value);
+  }
+}
+BENCHMARK(BM_LockRepeated);
+
+void BM_StdWeakPtrLock(benchmark::State &state) {
+  std::weak_ptr<Derived> weak = SharedStdTarget();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(weak.lock());
+}
+BENCHMARK(BM_StdWeakPtrLock)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+void BM_Copy(benchmark::State &state) {
+  xcpp::WeakPtr<Derived> weak = SharedTarget().weak_factory.GetWeakPtr();
+  for (auto _ : state) {
+    xcpp::WeakPtr<Derived> copy(weak);
+    benchmark::DoNotOptimize(copy);
+  }
+}
+BENCHMARK(BM_Copy)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+void BM_StdWeakPtrCopy(benchmark::State &state) {
+  std::weak_ptr<Derived> weak = SharedStdTarget();
+  for (auto _ : state) {
+    std::weak_ptr<Derived> copy(weak);
+    benchmark::DoNotOptimize(copy);
+  }
+}
+BENCHMARK(BM_StdWeakPtrCopy)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+// Every thread copies the WeakPtr of an owner of its own. The owners' flags
+// are allocated back to back up front: compact pooled flags share cache
+// lines, so the threads' reference counts false-share; cache-aligned ones
+// don't.
+template <typename Allocator> struct NeighbourOwner {
+  xcpp::WeakPtrFactory<NeighbourOwner, xcpp::internal::ThreadingChecker<void>,
+                       Allocator>
+      weak_factory{this};
+};
+
+template <typename Allocator>
+const std::vector<xcpp::WeakPtr<NeighbourOwner<Allocator>>> &
+NeighbourWeakPtrs() {
+  static auto *weaks = [] {
+    auto *owners = new NeighbourOwner<Allocator>[kMaxThreads];
+    auto *weaks = new std::vector<xcpp::WeakPtr<NeighbourOwner<Allocator>>>;
+    for (int i = 0; i < kMaxThreads; ++i)
+      weaks->push_back(owners[i].weak_factory.GetWeakPtr());
+    return weaks;
+  }();
+  return *weaks;
+}
+
+template <typename Allocator>
+void BM_NeighbourFlagCopy(benchmark::State &state) {
+  const auto &weak = NeighbourWeakPtrs<Allocator>()[state.thread_index()];
+  for (auto _ : state) {
+    xcpp::WeakPtr<NeighbourOwner<Allocator>> copy(weak);
+    benchmark::DoNotOptimize(copy);
+  }
+}
+BENCHMARK_TEMPLATE(BM_NeighbourFlagCopy, xcpp::PooledFlagAllocator<void>)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_NeighbourFlagCopy, xcpp::CacheAlignedFlagAllocator<void>)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+
+void BM_Move(benchmark::State &state) {
+  xcpp::WeakPtr<Derived> weak = SharedTarget().weak_factory.GetWeakPtr();
+  for (auto _ : state) {
+    xcpp::WeakPtr<Derived> moved(std::move(weak));
+    benchmark::DoNotOptimize(moved);
+    weak = std::move(moved);
+  }
+}
+BENCHMARK(BM_Move)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+void BM_StdWeakPtrMove(benchmark::State &state) {
+  std::weak_ptr<Derived> weak = SharedStdTarget();
+  for (auto _ : state) {
+    std::weak_ptr<Derived> moved(std::move(weak));
+    benchmark::DoNotOptimize(moved);
+    weak = std::move(moved);
+  }
+}
+BENCHMARK(BM_StdWeakPtrMove)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+void BM_ConvertingCopy(benchmark::State &state) {
+  xcpp::WeakPtr<Derived> weak = SharedTarget().weak_factory.GetWeakPtr();
+  for (auto _ : state) {
+    xcpp::WeakPtr<Base> base(weak);
+    benchmark::DoNotOptimize(base);
+  }
+}
+BENCHMARK(BM_ConvertingCopy)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+void BM_StdWeakPtrConvertingCopy(benchmark::State &state) {
+  std::weak_ptr<Derived> weak = SharedStdTarget();
+  for (auto _ : state) {
+    std::weak_ptr<Base> base(weak);
+    benchmark::DoNotOptimize(base);
+  }
+}
+BENCHMARK(BM_StdWeakPtrConvertingCopy)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+
+// Weak-bound callbacks, single-threaded like the task runners that run them.
+// The std::function variants capture the WeakPtr the hand-written way and
+// don't fit libstdc++'s inline buffer.
+
+void BM_BindWeak(benchmark::State &state) {
+  Derived target;
+  for (auto _ : state) {
+    xcpp::WeakCallback<int> callback =
+        xcpp::BindWeak(&Derived::Add, target.weak_factory.GetWeakPtr(), 1);
+    benchmark::DoNotOptimize(callback);
+  }
+}
+BENCHMARK(BM_BindWeak);
+
+void BM_StdFunctionWeakCapture(benchmark::State &state) {
+  Derived target;
+  for (auto _ : state) {
+    xcpp::WeakPtr<Derived> weak = target.weak_factory.GetWeakPtr();
+    std::function<void(int)> callback = [weak](int b) {
+      if (Derived *derived = weak.get())
+        derived->Add(1, b);
+    };
+    benchmark::DoNotOptimize(callback);
+  }
+}
+BENCHMARK(BM_StdFunctionWeakCapture);
+
+void BM_BindWeakRun(benchmark::State &state) {
+  Derived target;
+  xcpp::WeakCallback<int> callback =
+      xcpp::BindWeak(&Derived::Add, target.weak_factory.GetWeakPtr(), 1);
+  for (auto _ : state)
+    callback(2);
+  benchmark::DoNotOptimize(target.value);
+}
+BENCHMARK(BM_BindWeakRun);
+
+void BM_StdFunctionWeakRun(benchmark::State &state) {
+  Derived target;
+  xcpp::WeakPtr<Derived> weak = target.weak_factory.GetWeakPtr();
+  std::function<void(int)> callback = [weak](int b) {
+    if (Derived *derived = weak.get())
+      derived->Add(1, b);
+  };
+  for (auto _ : state)
+    callback(2);
+  benchmark::DoNotOptimize(target.value);
+}
+BENCHMARK(BM_StdFunctionWeakRun);
+
+// Weak-keyed caches: lookups by raw pointer in a table of kMapEntries live
+// keys, against std::unordered_map keyed by the address with the WeakPtr
+// checked on every hit.
+
+constexpr int kMapEntries = 1024;
+
+void BM_WeakKeyMapFind(benchmark::State &state) {
+  std::vector<std::unique_ptr<Derived>> keys;
+  xcpp::WeakKeyMap<Derived, int> map;
+  for (int i = 0; i < kMapEntries; ++i) {
+    keys.emplace_back(new Derived);
+    map.Insert(keys.back()->weak_factory.GetWeakPtr(), i);
+  }
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(map.Find(keys[i++ % keys.size()].get()));
+}
+BENCHMARK(BM_WeakKeyMapFind);
+
+void BM_StdUnorderedMapWeakFind(benchmark::State &state) {
+  std::vector<std::unique_ptr<Derived>> keys;
+  std::unordered_map<const Derived *, std::pair<xcpp::WeakPtr<Derived>, int>>
+      map;
+  for (int i = 0; i < kMapEntries; ++i) {
+    keys.emplace_back(new Derived);
+    map.emplace(keys.back().get(),
+                std::make_pair(keys.back()->weak_factory.GetWeakPtr(), i));
+  }
+  std::size_t i = 0;
+  for (auto _ : state) {
+    auto it = map.find(keys[i++ % keys.size()].get());
+    benchmark::DoNotOptimize(it != map.end() && it->second.first ? &it->second
+                                                                  : nullptr);
+  }
+}
+BENCHMARK(BM_StdUnorderedMapWeakFind);
+
+// Keys die right after insertion; the map has to reclaim them as it goes.
+void BM_WeakKeyMapChurn(benchmark::State &state) {
+  xcpp::WeakKeyMap<Derived, int> map;
+  for (auto _ : state) {
+    Derived key;
+    map.Insert(key.weak_factory.GetWeakPtr(), 1);
+  }
+  state.counters["capacity"] = static_cast<double>(map.capacity());
+}
+BENCHMARK(BM_WeakKeyMapChurn);
+
+// Routing tables keyed by the type-erased handle: hashing and equality read
+// the cached words only, recovering the typed WeakPtr is a tag compare.
+void BM_WeakPtrVoidRouteFind(benchmark::State &state) {
+  std::vector<std::unique_ptr<Derived>> objects;
+  std::unordered_map<xcpp::WeakPtr<void>, int> routes;
+  std::vector<xcpp::WeakPtr<void>> keys;
+  for (int i = 0; i < kMapEntries; ++i) {
+    objects.emplace_back(new Derived);
+    keys.push_back(objects.back()->weak_factory.GetWeakPtr());
+    routes.emplace(keys.back(), i);
+  }
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(routes.find(keys[i++ % keys.size()]));
+}
+BENCHMARK(BM_WeakPtrVoidRouteFind);
+
+void BM_AnyWeakPtrAs(benchmark::State &state) {
+  Derived derived;
+  xcpp::AnyWeakPtr any = derived.weak_factory.GetWeakPtr();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(any.As<Derived>().get());
+}
+BENCHMARK(BM_AnyWeakPtrAs);
+
+// Arena handles: 8 bytes and no control block, against WeakPtr::get() on the
+// same number of objects.
+
+void BM_GenerationalWeakPtrGet(benchmark::State &state) {
+  xcpp::SlotArena<Base> arena;
+  std::vector<xcpp::GenerationalWeakPtr<Base>> handles;
+  for (int i = 0; i < kMapEntries; ++i)
+    handles.push_back(arena.New());
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(handles[i++ % handles.size()].get());
+}
+BENCHMARK(BM_GenerationalWeakPtrGet);
+
+void BM_WeakPtrGetMany(benchmark::State &state) {
+  std::vector<std::unique_ptr<Derived>> objects;
+  std::vector<xcpp::WeakPtr<Derived>> weaks;
+  for (int i = 0; i < kMapEntries; ++i) {
+    objects.emplace_back(new Derived);
+    weaks.push_back(objects.back()->weak_factory.GetWeakPtr());
+  }
+  std::size_t i = 0;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(weaks[i++ % weaks.size()].get());
+}
+BENCHMARK(BM_WeakPtrGetMany);
+
+// The owner-side calls are single-sequence by contract.
+
+// One hand-out/invalidate cycle: InvalidateWeakPtrs() on a factory that has
+// no flag is a no-op, so the lazily allocated flag is part of the cost.
+void BM_InvalidateWeakPtrs(benchmark::State &state) {
+  Derived target;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(target.weak_factory.GetWeakPtr());
+    target.weak_factory.InvalidateWeakPtrs();
+  }
+}
+BENCHMARK(BM_InvalidateWeakPtrs);
+
+// Shard teardown: range(0) objects with one live WeakPtr each. The group
+// kills all WeakPtrs with one store before the objects are destroyed; the
+// per-object cost should not grow with the shard size.
+void BM_WeakGroupTeardown(benchmark::State &state) {
+  const std::size_t count = static_cast<std::size_t>(state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    xcpp::WeakGroup<> group;
+    std::vector<std::unique_ptr<Derived>> objects(count);
+    std::vector<xcpp::WeakPtr<Derived>> weaks(count);
+    for (std::size_t i = 0; i < count; ++i) {
+      objects[i].reset(new Derived);
+      objects[i]->weak_factory.JoinGroup(group);
+      weaks[i] = objects[i]->weak_factory.GetWeakPtr();
+    }
+    state.ResumeTiming();
+    group.InvalidateWeakPtrs();
+    objects.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_WeakGroupTeardown)->Range(1 << 10, 1 << 16);
+
+void BM_StdSharedPtrReset(benchmark::State &state) {
+  for (auto _ : state) {
+    auto shared = std::make_shared<Derived>();
+    std::weak_ptr<Derived> weak = shared;
+    shared.reset();
+    benchmark::DoNotOptimize(weak);
+  }
+}
+BENCHMARK(BM_StdSharedPtrReset);
+
+void BM_HasWeakPtrs(benchmark::State &state) {
+  Derived target;
+  xcpp::WeakPtr<Derived> weak = target.weak_factory.GetWeakPtr();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(target.weak_factory.HasWeakPtrs());
+}
+BENCHMARK(BM_HasWeakPtrs);
+
+void BM_StdWeakPtrUseCount(benchmark::State &state) {
+  std::weak_ptr<Derived> weak = SharedStdTarget();
+  for (auto _ : state)
+    benchmark::DoNotOptimize(weak.use_count());
+}
+BENCHMARK(BM_StdWeakPtrUseCount);
+
+} // namespace
@@ -0,0 +1,74 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// Compares the ns/op of WeakPtr<T>::get() against the previous dereference
+// path, which checked a std::weak_ptr to the threading checker and then
+// locked a std::weak_ptr to the object.
+//
+//   g++ -std=c++14 -O2 -I. bench/weak_ptr_get_bench.cc -pthread
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+#include "base/weak_ptr.h"
+
+namespace {
+
+struct Target : public std::enable_shared_from_this<Target> {
+  int value = 1;
+  xcpp::WeakPtrFactory<Target> weak_factory{this};
+};
+
+// The dereference sequence used before the intrusive flag existed.
+struct LegacyWeakRef {
+  std::weak_ptr<void> threading_checker;
+  std::weak_ptr<Target> ptr;
+
+  Target *get() const {
+    if (threading_checker.expired())
+      return nullptr;
+    auto checker = threading_checker.lock();
+    if (!checker)
+      return nullptr;
+    return ptr.lock().get();
+  }
+};
+
+template <typename T> inline void DoNotOptimize(T const &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+template <typename Deref> double NanosecondsPerOp(long iterations, Deref deref) {
+  const auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < iterations; ++i)
+    DoNotOptimize(deref());
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+} // namespace
+
+int main() {
+  const long kIterations = 50 * 1000 * 1000;
+
+  auto target = std::make_shared<Target>();
+  auto checker = std::make_shared<int>();
+  LegacyWeakRef legacy{checker, target};
+  xcpp::WeakPtr<Target> weak = target->weak_factory.GetWeakPtr();
+
+  const double legacy_ns =
+      NanosecondsPerOp(kIterations, [&] { return legacy.get(); });
+  const double weak_ns =
+      NanosecondsPerOp(kIterations, [&] { return weak.get(); });
+
+  std::printf("legacy weak_ptr::lock() get(): %6.2f ns/op\n", legacy_ns);
+  std::printf("flag WeakPtr::get():           %6.2f ns/op\n", weak_ns);
+  std::printf("speedup:                       %6.2fx\n", legacy_ns / weak_ns);
+  return 0;
+}
@@ -0,0 +1,17 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// Compiled to assembly only, never linked: check_get_codegen.cmake reads the
+// body of the function below to make sure a release WeakPtr<T>::get() stays
+// a handful of loads and branches, with no call, lock or fence.
+
+#include "base/weak_ptr.h"
+
+extern "C" int *xlib_weak_ptr_get_codegen(const xcpp::WeakPtr<int> &weak) {
+  return weak.get();
+}
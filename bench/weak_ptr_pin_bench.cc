@@ -0,0 +1,83 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// Reader scalability of the concurrent pin backends: every thread pins the same
+// popular object. std::weak_ptr::lock() and the counted WeakPin both write the
+// shared control block; the hazard-pointer WeakPin only writes the reading
+// thread's own slot.
+
+#include <memory>
+
+#include <benchmark/benchmark.h>
+
+#include "base/weak_ptr.h"
+
+namespace {
+
+constexpr int kMaxThreads = 64;
+
+template <typename Threading>
+struct Target : public std::enable_shared_from_this<Target<Threading>> {
+  int value = 1;
+  xcpp::WeakPtrFactory<Target, Threading> weak_factory{this};
+};
+
+template <typename Threading> Target<Threading> &SharedTarget() {
+  static auto *target = [] {
+    auto *object = new Target<Threading>;
+    object->weak_factory.GetWeakPtr();
+    return object;
+  }();
+  return *target;
+}
+
+template <typename Threading> void BM_WeakPin(benchmark::State &state) {
+  using Object = Target<Threading>;
+  xcpp::WeakPtr<Object> weak =
+      SharedTarget<Threading>().weak_factory.GetWeakPtr();
+  for (auto _ : state) {
+    xcpp::WeakPin<Object> pin(weak);
+    benchmark::DoNotOptimize(pin->value);
+  }
+}
+BENCHMARK_TEMPLATE(BM_WeakPin, xcpp::internal::ConcurrentThreadingChecker)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_WeakPin, xcpp::internal::HazardThreadingChecker)
+    ->ThreadRange(1, kMaxThreads)
+    ->UseRealTime();
+
+void BM_StdWeakPtrPin(benchmark::State &state) {
+  using Object = Target<xcpp::internal::ConcurrentThreadingChecker>;
+  static auto *target = new std::shared_ptr<Object>(new Object);
+  std::weak_ptr<Object> weak = *target;
+  for (auto _ : state) {
+    std::shared_ptr<Object> pin = weak.lock();
+    benchmark::DoNotOptimize(pin->value);
+  }
+}
+BENCHMARK(BM_StdWeakPtrPin)->ThreadRange(1, kMaxThreads)->UseRealTime();
+
+// The owner side: the hazard backend scans every registered thread's slots on
+// invalidation, the counted one loads the pin count once.
+template <typename Threading>
+void BM_InvalidateAfterPin(benchmark::State &state) {
+  using Object = Target<Threading>;
+  Object target;
+  for (auto _ : state) {
+    xcpp::WeakPtr<Object> weak = target.weak_factory.GetWeakPtr();
+    { xcpp::WeakPin<Object> pin(weak); }
+    target.weak_factory.InvalidateWeakPtrs();
+  }
+}
+BENCHMARK_TEMPLATE(BM_InvalidateAfterPin,
+                   xcpp::internal::ConcurrentThreadingChecker);
+BENCHMARK_TEMPLATE(BM_InvalidateAfterPin,
+                   xcpp::internal::HazardThreadingChecker);
+
+} // namespace
@@ -0,0 +1,218 @@
+///////////////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2017 The Authors of xlib(http:://xlib.org) . All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+///////////////////////////////////////////////////////////////////////////////////////////
+
+// Contention harness for cross-thread WeakPtr use. Invalidator threads own a
+// range of objects each; they keep calling GetWeakPtr() and publishing the
+// result, InvalidateWeakPtrs() and destroying objects outright. Producer
+// threads copy published WeakPtrs and dereference the copies. Reported per
+// threading policy: dereference throughput, p50/p99 dereference latency
+// (sampled) and the ratio of dereferences that found the object gone.
+//
+//   xlib_weak_ptr_stress [producers=4] [invalidators=2] [seconds=1]
+//
+// Concurrent policies pin the object and read it. ThreadingChecker<std::mutex>
+// is the baseline: off its sequence only the validity check is legal, which
+// also means it needs an NDEBUG build, as get() asserts the sequence
+// otherwise. Build with -DXLIB_SANITIZER=thread or =address to run it under
+// a sanitizer.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "base/weak_ptr.h"
+
+namespace {
+
+constexpr int kSlotsPerInvalidator = 64;
+// Every kSampleEvery-th dereference is timed.
+constexpr std::uint64_t kSampleEvery = 16;
+constexpr std::size_t kMaxSamplesPerThread = 1 << 20;
+
+template <typename Threading> struct Object {
+  explicit Object(std::uint64_t payload) : payload(payload) {}
+  // First thing, so no member goes away under a pin.
+  ~Object() { weak_factory.InvalidateWeakPtrs(); }
+
+  const std::uint64_t payload;
+  xcpp::WeakPtrFactory<Object, Threading> weak_factory{this};
+};
+
+template <typename Threading> struct Slot {
+  std::mutex mutex;
+  xcpp::WeakPtr<Object<Threading>> weak;
+};
+
+template <typename Threading>
+bool Deref(const xcpp::WeakPtr<Object<Threading>> &weak, std::uint64_t *sink,
+           std::true_type /* concurrent */) {
+  xcpp::WeakPin<Object<Threading>> pin(weak);
+  if (!pin)
+    return false;
+  *sink += pin->payload;
+  return true;
+}
+
+template <typename Threading>
+bool Deref(const xcpp::WeakPtr<Object<Threading>> &weak, std::uint64_t *,
+           std::false_type /* concurrent */) {
+  return weak.get() != nullptr;
+}
+
+struct ProducerResult {
+  std::uint64_t derefs = 0;
+  std::uint64_t failed = 0;
+  std::uint64_t sink = 0;
+  std::vector<std::uint32_t> samples_ns;
+};
+
+struct Options {
+  int producers = 4;
+  int invalidators = 2;
+  double seconds = 1;
+};
+
+template <typename Threading>
+void Producer(std::vector<Slot<Threading>> *slots,
+              const std::atomic<bool> *stop, unsigned seed,
+              ProducerResult *result) {
+  using Concurrent = std::integral_constant<bool, Threading::kConcurrent>;
+  result->samples_ns.reserve(kMaxSamplesPerThread);
+  unsigned state = seed | 1;
+  while (!stop->load(std::memory_order_relaxed)) {
+    state = state * 1664525u + 1013904223u;
+    Slot<Threading> &slot = (*slots)[(state >> 8) % slots->size()];
+    xcpp::WeakPtr<Object<Threading>> weak;
+    {
+      std::lock_guard<std::mutex> lock(slot.mutex);
+      weak = slot.weak;
+    }
+    bool valid;
+    if (result->derefs % kSampleEvery == 0 &&
+        result->samples_ns.size() < kMaxSamplesPerThread) {
+      const auto start = std::chrono::steady_clock::now();
+      valid = Deref(weak, &result->sink, Concurrent());
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      result->samples_ns.push_back(static_cast<std::uint32_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count()));
+    } else {
+      valid = Deref(weak, &result->sink, Concurrent());
+    }
+    ++result->derefs;
+    if (!valid)
+      ++result->failed;
+  }
+}
+
+// Owns slots [first, first + kSlotsPerInvalidator). Odd rounds invalidate and
+// re-issue, even rounds replace the object.
+template <typename Threading>
+void Invalidator(std::vector<Slot<Threading>> *slots, int first,
+                 const std::atomic<bool> *stop, std::uint64_t *operations) {
+  std::vector<std::unique_ptr<Object<Threading>>> objects;
+  for (int i = 0; i < kSlotsPerInvalidator; ++i)
+    objects.emplace_back(new Object<Threading>(i));
+  std::uint64_t round = 0;
+  while (!stop->load(std::memory_order_relaxed)) {
+    const int i = static_cast<int>(round % kSlotsPerInvalidator);
+    if (round & 1) {
+      objects[i]->weak_factory.InvalidateWeakPtrs();
+    } else {
+      objects[i].reset();
+      objects[i].reset(new Object<Threading>(round));
+    }
+    xcpp::WeakPtr<Object<Threading>> weak =
+        objects[i]->weak_factory.GetWeakPtr();
+    {
+      Slot<Threading> &slot = (*slots)[first + i];
+      std::lock_guard<std::mutex> lock(slot.mutex);
+      slot.weak = std::move(weak);
+    }
+    ++round;
+  }
+  *operations = round;
+}
+
+template <typename Threading>
+void Run(const char *name, const Options &options) {
+  std::vector<Slot<Threading>> slots(options.invalidators *
+                                     kSlotsPerInvalidator);
+  std::vector<ProducerResult> results(options.producers);
+  std::vector<std::uint64_t> operations(options.invalidators);
+  std::atomic<bool> stop{false};
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < options.invalidators; ++i)
+    threads.emplace_back(Invalidator<Threading>, &slots,
+                         i * kSlotsPerInvalidator, &stop, &operations[i]);
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < options.producers; ++i)
+    threads.emplace_back(Producer<Threading>, &slots, &stop,
+                         static_cast<unsigned>(i * 7919 + 1), &results[i]);
+  std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+  stop.store(true, std::memory_order_relaxed);
+  for (auto &thread : threads)
+    thread.join();
+  const double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+
+  std::uint64_t derefs = 0, failed = 0, invalidator_ops = 0;
+  std::vector<std::uint32_t> samples;
+  for (const auto &result : results) {
+    derefs += result.derefs;
+    failed += result.failed;
+    samples.insert(samples.end(), result.samples_ns.begin(),
+                   result.samples_ns.end());
+  }
+  for (std::uint64_t ops : operations)
+    invalidator_ops += ops;
+  std::sort(samples.begin(), samples.end());
+  const auto percentile = [&samples](std::size_t p) -> unsigned {
+    return samples.empty() ? 0 : samples[samples.size() * p / 100];
+  };
+
+  std::printf("%-22s %12.0f %10.0f %8u %8u %9.3f%%\n", name, derefs / elapsed,
+              invalidator_ops / elapsed, percentile(50), percentile(99),
+              derefs ? 100.0 * failed / derefs : 0.0);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  if (argc > 1)
+    options.producers = std::max(1, std::atoi(argv[1]));
+  if (argc > 2)
+    options.invalidators = std::max(1, std::atoi(argv[2]));
+  if (argc > 3)
+    options.seconds = std::max(0.01, std::atof(argv[3]));
+
+  std::printf("%d producers, %d invalidators, %.2fs per policy\n",
+              options.producers, options.invalidators, options.seconds);
+  std::printf("%-22s %12s %10s %8s %8s %10s\n", "policy", "derefs/s",
+              "issues/s", "p50 ns", "p99 ns", "failed");
+#ifdef NDEBUG
+  Run<xcpp::internal::ThreadingChecker<std::mutex>>("mutex (baseline)",
+                                                    options);
+#else
+  std::printf("%-22s skipped, needs NDEBUG\n", "mutex (baseline)");
+#endif // NDEBUG
+  Run<xcpp::internal::ConcurrentThreadingChecker>("concurrent", options);
+  Run<xcpp::internal::HazardThreadingChecker>("hazard", options);
+  return 0;
+}